@@ -0,0 +1,186 @@
+#include "our_gl.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+const size_t passes = 20;
+
+using Triangle = std::array<vec3f, 3>;  // screen x, y and depth in [0, 255]
+
+// Depth storage as it was before the tiled buffer: one double per pixel at x * width + y,
+// filled by walking the bounding box column by column.
+struct ColumnMajorDepth
+{
+    size_t width, height;
+    std::vector<double> data;
+    ColumnMajorDepth(size_t w, size_t h) : width(w), height(h), data(w * h) {}
+    double &at(size_t x, size_t y) { return data[x * width + y]; }
+};
+
+// Same storage order as TGAImage, walked row by row
+struct RowMajorDepth
+{
+    size_t width, height;
+    std::vector<double> data;
+    RowMajorDepth(size_t w, size_t h) : width(w), height(h), data(w * h) {}
+    double &at(size_t x, size_t y) { return data[x + y * width]; }
+};
+
+// depth of the pixel center (x, y) if it is covered by t
+bool depth_at(const Triangle &t, int x, int y, double &depth)
+{
+    vec2f p(x, y);
+    double area = (t[1].x - t[0].x) * (t[2].y - t[0].y) - (t[2].x - t[0].x) * (t[1].y - t[0].y);
+    if (std::abs(area) < 1e-2) return false;
+    double b1 = ((p.x - t[0].x) * (t[2].y - t[0].y) - (t[2].x - t[0].x) * (p.y - t[0].y)) / area;
+    double b2 = ((t[1].x - t[0].x) * (p.y - t[0].y) - (p.x - t[0].x) * (t[1].y - t[0].y)) / area;
+    double b0 = 1. - b1 - b2;
+    if (b0 < 0 || b1 < 0 || b2 < 0) return false;
+    depth = t[0].z * b0 + t[1].z * b1 + t[2].z * b2;
+    return true;
+}
+
+void bbox(const Triangle &t, int size, int &xmin, int &xmax, int &ymin, int &ymax)
+{
+    xmin = ymin = size - 1;
+    xmax = ymax = 0;
+    for (auto &v : t) {
+        xmin = std::max(0, std::min(xmin, static_cast<int>(v.x)));
+        ymin = std::max(0, std::min(ymin, static_cast<int>(v.y)));
+        xmax = std::min(size - 1, std::max(xmax, static_cast<int>(v.x) + 1));
+        ymax = std::min(size - 1, std::max(ymax, static_cast<int>(v.y) + 1));
+    }
+}
+
+template <class Buffer>
+size_t column_pass(const std::vector<Triangle> &tris, Buffer &zbuffer, int size)
+{
+    size_t written = 0;
+    for (auto &t : tris) {
+        int xmin, xmax, ymin, ymax;
+        bbox(t, size, xmin, xmax, ymin, ymax);
+        for (int x = xmin; x <= xmax; x++)
+            for (int y = ymin; y <= ymax; y++) {
+                double depth;
+                if (!depth_at(t, x, y, depth)) continue;
+                double &stored = zbuffer.at(static_cast<size_t>(x), static_cast<size_t>(y));
+                if (stored > depth) continue;
+                stored = depth;
+                written++;
+            }
+    }
+    return written;
+}
+
+template <class Buffer>
+size_t row_pass(const std::vector<Triangle> &tris, Buffer &zbuffer, int size)
+{
+    size_t written = 0;
+    for (auto &t : tris) {
+        int xmin, xmax, ymin, ymax;
+        bbox(t, size, xmin, xmax, ymin, ymax);
+        for (int y = ymin; y <= ymax; y++)
+            for (int x = xmin; x <= xmax; x++) {
+                double depth;
+                if (!depth_at(t, x, y, depth)) continue;
+                double &stored = zbuffer.at(static_cast<size_t>(x), static_cast<size_t>(y));
+                if (stored > depth) continue;
+                stored = depth;
+                written++;
+            }
+    }
+    return written;
+}
+
+// the traversal triangle() uses: tile by tile, row major inside a tile
+template <class Format>
+size_t tiled_pass(const std::vector<Triangle> &tris, DepthBuffer<Format> &zbuffer, int size)
+{
+    const int tile = static_cast<int>(DepthBuffer<Format>::tile_size);
+    size_t written = 0;
+    for (auto &t : tris) {
+        int xmin, xmax, ymin, ymax;
+        bbox(t, size, xmin, xmax, ymin, ymax);
+        for (int ty = ymin & -tile; ty <= ymax; ty += tile)
+            for (int tx = xmin & -tile; tx <= xmax; tx += tile)
+                for (int y = std::max(ty, ymin); y <= std::min(ty + tile - 1, ymax); y++)
+                    for (int x = std::max(tx, xmin); x <= std::min(tx + tile - 1, xmax); x++) {
+                        double depth;
+                        if (!depth_at(t, x, y, depth)) continue;
+                        size_t px = static_cast<size_t>(x), py = static_cast<size_t>(y);
+                        auto encoded = Format::encode(depth);
+                        if (!Format::passes(encoded, zbuffer.load(px, py))) continue;
+                        zbuffer.store(px, py, encoded);
+                        written++;
+                    }
+    }
+    return written;
+}
+
+template <class Pass>
+void report(const char *name, size_t tested, size_t bytes, Pass pass)
+{
+    size_t written = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < passes; i++) written = pass();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                    .count() /
+                passes;
+    std::cout << name << ": " << ms << " ms/pass, " << static_cast<double>(tested) / ms / 1e3
+              << " Mtests/s, " << written << " writes, " << bytes / 1024 << " KiB" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string filename = argc > 1 ? argv[1] : "obj/diablo3_pose.obj";
+    int size = argc > 2 ? std::stoi(argv[2]) : 1000;
+    Model model(filename);
+
+    vec3f eye(1, 1, 3), center(0, 0, 0), up(0, 1, 0);
+    mat4 M = viewport(size / 8, size / 8, size * 3 / 4, size * 3 / 4) *
+             projection(-1. / (eye - center).norm()) * lookat(eye, center, up);
+    std::vector<Triangle> tris(model.nfaces());
+    for (size_t i = 0; i < model.nfaces(); i++)
+        for (size_t j = 0; j < 3; j++) {
+            vec4f v = M * embed<4>(model.vert(i, j));
+            tris[i][j] = proj<3>(v / v[3]);
+        }
+
+    // covered pixels, i.e. depth tests per pass, the same for every variant
+    size_t tested = 0;
+    for (auto &t : tris) {
+        int xmin, xmax, ymin, ymax;
+        bbox(t, size, xmin, xmax, ymin, ymax);
+        double depth;
+        for (int y = ymin; y <= ymax; y++)
+            for (int x = xmin; x <= xmax; x++) tested += depth_at(t, x, y, depth);
+    }
+
+    size_t n = static_cast<size_t>(size);
+    ColumnMajorDepth column(n, n);
+    report("column major double (before)", tested, n * n * sizeof(double), [&]() {
+        std::fill(column.data.begin(), column.data.end(), 0.);
+        return column_pass(tris, column, size);
+    });
+    RowMajorDepth row(n, n);
+    report("row major double", tested, n * n * sizeof(double), [&]() {
+        std::fill(row.data.begin(), row.data.end(), 0.);
+        return row_pass(tris, row, size);
+    });
+    auto tiled = [&](const char *name, auto format) {
+        using Format = decltype(format);
+        DepthBuffer<Format> zbuffer(n, n);
+        report(name, tested, zbuffer.memory_bytes(), [&]() {
+            zbuffer.clear();
+            return tiled_pass(tris, zbuffer, size);
+        });
+    };
+    tiled("tiled 8x8 double", DepthFloat64{});
+    tiled("tiled 8x8 float", DepthFloat32{});
+    tiled("tiled 8x8 reverse-z float", ReverseZ<DepthFloat32>{});
+    tiled("tiled 8x8 unorm24", DepthUnorm24{});
+    tiled("tiled 8x8 unorm16", DepthUnorm16{});
+    return 0;
+}
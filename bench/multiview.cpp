@@ -0,0 +1,106 @@
+#include "our_gl.h"
+#include "shaders.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+
+vec3f light_dir = vec3f(1, 1, 1).normalize();
+vec3f center(0, 0, 0);
+vec3f up(0, 1, 0);
+
+using Format = ReverseZ<DepthFloat32>;
+
+// the lesson-7 shader and targets of one camera
+struct Camera
+{
+    std::unique_ptr<Shader<DepthUnorm16>> shader;
+    TGAImage image;
+    DepthBuffer<Format> zbuffer;
+
+    Camera(vec3f eye, size_t size, const ShadowMap<> &shadow_map)
+        : image(size, size, TGAImage::RGB), zbuffer(size, size, true)
+    {
+        int s = static_cast<int>(size);
+        mat4 ModelView = lookat(eye, center, up);
+        mat4 Projection = projection(-1. / (eye - center).norm());
+        mat4 Viewport = viewport(s / 8, s / 8, s * 3 / 4, s * 3 / 4);
+        shader = std::make_unique<Shader<DepthUnorm16>>(
+            camera_shader(ModelView, Projection, Viewport, light_dir, shadow_map));
+    }
+
+    void clear()
+    {
+        image.clear();
+        zbuffer.clear();
+    }
+};
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+// views of the cameras one by one, as separate runs would, then in one multi-view draw
+void compare(const char *name, Model &model, std::vector<Camera> &cameras)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (Camera &camera : cameras) {
+        camera.clear();
+        std::array<vec4f, 3> pts;
+        for (size_t i = 0; i < model.nfaces(); i++) {
+            for (size_t j = 0; j < 3; j++)
+                pts[j] = camera.shader->vertex(model, static_cast<int>(i), static_cast<int>(j));
+            triangle(model, pts, *camera.shader, camera.image, camera.zbuffer);
+        }
+    }
+    double separate = elapsed_ms(start);
+    std::vector<TGAImage> reference;
+    for (Camera &camera : cameras) reference.push_back(camera.image);
+
+    std::vector<ViewTarget<Format>> views;
+    for (Camera &camera : cameras)
+        views.push_back({camera.shader.get(), &camera.image, &camera.zbuffer});
+    std::cout << name << ": separate " << separate << " ms";
+    for (size_t nthreads : {size_t{1}, size_t{4}}) {
+        for (Camera &camera : cameras) camera.clear();
+        start = std::chrono::steady_clock::now();
+        multiview_draw(model, views, nthreads);
+        double ms = elapsed_ms(start);
+        size_t differing = 0;
+        for (size_t v = 0; v < cameras.size(); v++)
+            for (size_t y = 0; y < reference[v].get_height(); y++)
+                for (size_t x = 0; x < reference[v].get_width(); x++) {
+                    TGAColor a = cameras[v].image.get(x, y), b = reference[v].get(x, y);
+                    differing += a[0] != b[0] || a[1] != b[1] || a[2] != b[2];
+                }
+        std::cout << ", multi-view on " << nthreads << " threads " << ms << " ms (" << differing
+                  << " pixels differ)";
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string filename = argc > 1 ? argv[1] : "obj/african_head.obj";
+    Model model{filename, true, true, true};
+    model.set_texture_filter(TextureFilter::Trilinear);
+    ShadowMap<> shadow_map(1024, 1024);
+    shadow_map.fit(model, light_dir, up);
+    shadow_map.render(model);
+
+    std::vector<Camera> stereo;
+    for (double dx : {-.03, .03}) stereo.emplace_back(vec3f(1 + dx, 1, 3), 1000, shadow_map);
+    compare("stereo pair, 1000x1000", model, stereo);
+
+    std::vector<Camera> turntable;
+    for (size_t v = 0; v < 16; v++) {
+        double a = 2 * M_PI * static_cast<double>(v) / 16;
+        turntable.emplace_back(vec3f(3 * std::sin(a), 1, 3 * std::cos(a)), 128, shadow_map);
+    }
+    compare("turntable of 16 thumbnails, 128x128", model, turntable);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "tgaimage.h"
+#include "resample.h"
+
+#include <iostream>
+#include <string>
+
+const size_t thumb_size = 128;
+
+int main(int argc, char **argv)
+{
+    std::string filename = argc > 1 ? argv[1] : "obj/african_head_diffuse.tga";
+    TGAImage src;
+    if (!src.read_tga_file(filename)) return 1;
+
+    const std::pair<ResampleFilter, const char *> filters[] = {
+        {ResampleFilter::Box, "box"},
+        {ResampleFilter::Bilinear, "bilinear"},
+        {ResampleFilter::Lanczos3, "lanczos3"}};
+
+    for (auto &f : filters) {
+        TGAImage thumb;
+        ResampleStats stats = resample(src, thumb, thumb_size, thumb_size, f.first);
+        std::cout << f.second << " thumbnail " << thumb_size << "x" << thumb_size << ": "
+                  << stats.seconds * 1000. << " ms" << std::endl;
+        thumb.write_tga_file(std::string("thumbnail_") + f.second + ".tga");
+
+        TGAImage half;
+        stats = resample(src, half, src.get_width() / 2, src.get_height() / 2, f.first);
+        std::cout << f.second << " 2x resolve: " << stats.megapixels_per_sec << " MP/s"
+                  << std::endl;
+
+        TGAImage twice;
+        stats = resample(src, twice, src.get_width() * 2, src.get_height() * 2, f.first);
+        std::cout << f.second << " 2x enlarge: " << stats.megapixels_per_sec << " MP/s"
+                  << std::endl;
+    }
+
+    TGAImage inplace = src;
+    ResampleStats stats = downsample_2x(inplace);
+    std::cout << "in-place downsample_2x: " << stats.megapixels_per_sec << " MP/s" << std::endl;
+    inplace.write_tga_file("downsample_2x.tga");
+    return 0;
+}
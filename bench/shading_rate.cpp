@@ -0,0 +1,107 @@
+#include "our_gl.h"
+#include "shaders.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+vec3f light_dir = vec3f(1, 1, 1).normalize();
+vec3f eye(1, 1, 3);
+vec3f center(0, 0, 0);
+vec3f up(0, 1, 0);
+
+struct Frame
+{
+    TGAImage image;
+    double ms = 0;
+};
+
+// PSNR of the color channels of image against ref
+double psnr(const TGAImage &ref, const TGAImage &image)
+{
+    double se = 0;
+    size_t n = 0;
+    for (size_t y = 0; y < ref.get_height(); y++)
+        for (size_t x = 0; x < ref.get_width(); x++) {
+            TGAColor a = ref.get(x, y), b = image.get(x, y);
+            for (size_t c = 0; c < 3; c++) {
+                double d = a[c] - b[c];
+                se += d * d;
+                n++;
+            }
+        }
+    if (se == 0) return INFINITY;
+    return 10 * std::log10(255. * 255. * static_cast<double>(n) / se);
+}
+
+// the lesson-7 color pass with rates, which prepare() fills after the depth pre-pass
+template <class Prepare>
+Frame render(Model &model, const ShadowMap<> &shadow_map, size_t size, ShadingRateMap *rates,
+             Prepare prepare)
+{
+    int s = static_cast<int>(size);
+    mat4 Viewport = viewport(s / 8, s / 8, s * 3 / 4, s * 3 / 4);
+    mat4 ModelView = lookat(eye, center, up);
+    mat4 Projection = projection(-1. / (eye - center).norm());
+    mat4 Screen = Viewport * Projection * ModelView;
+    Frame frame{TGAImage(size, size, TGAImage::RGB)};
+    DepthBuffer<ReverseZ<DepthFloat32>> zbuffer(size, size, true);
+    Shader shader = camera_shader(ModelView, Projection, Viewport, light_dir, shadow_map);
+    shader.shading_rate = rates;
+    auto start = std::chrono::steady_clock::now();
+    depth_pass(model, Screen, zbuffer);
+    prepare(zbuffer);
+    std::array<vec4f, 3> screen_coords;
+    for (size_t i = 0; i < model.nfaces(); i++) {
+        for (size_t j = 0; j < 3; j++)
+            screen_coords[j] = shader.vertex(model, static_cast<int>(i), static_cast<int>(j));
+        triangle(model, screen_coords, shader, frame.image, zbuffer);
+    }
+    frame.ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return frame;
+}
+
+int main(int argc, char **argv)
+{
+    std::string filename = argc > 1 ? argv[1] : "obj/african_head.obj";
+    size_t size = argc > 2 ? std::stoul(argv[2]) : 1000;
+    Model model{filename, true, true, true};
+    model.set_texture_filter(TextureFilter::Trilinear);
+    ShadowMap<> shadow_map(1024, 1024);
+    shadow_map.fit(model, light_dir, up);
+    shadow_map.render(model);
+
+    ShadingRateMap full_rates(size, size);
+    Frame full = render(model, shadow_map, size, &full_rates, [](auto &) {});
+    size_t pixels = full_rates.stats.pixels;
+    std::cout << "full rate: " << full.ms << " ms, " << full_rates.stats.invocations
+              << " fragment shader runs" << std::endl;
+
+    auto report = [&](const char *name, ShadingRateMap &rates, const Frame &frame) {
+        ShadingRateStats &st = rates.stats;
+        std::cout << name << ": " << frame.ms << " ms, " << st.invocations
+                  << " fragment shader runs ("
+                  << static_cast<double>(pixels) / static_cast<double>(st.invocations)
+                  << "x fewer), tiles " << rates.count(ShadingRate::Full) << "/"
+                  << rates.count(ShadingRate::Coarse2x2) << "/"
+                  << rates.count(ShadingRate::Coarse4x4) << " full/2x2/4x4, PSNR "
+                  << psnr(full.image, frame.image) << " dB" << std::endl;
+    };
+    for (ShadingRate rate : {ShadingRate::Coarse2x2, ShadingRate::Coarse4x4}) {
+        ShadingRateMap rates(size, size, rate);
+        Frame frame = render(model, shadow_map, size, &rates, [](auto &) {});
+        report(rate == ShadingRate::Coarse2x2 ? "2x2" : "4x4", rates, frame);
+    }
+    ShadingRateMap by_depth(size, size);
+    Frame frame = render(model, shadow_map, size, &by_depth,
+                         [&](const auto &zbuffer) { by_depth.adapt(zbuffer); });
+    report("adaptive, depth", by_depth, frame);
+    // the full rate frame stands in for the previous one
+    ShadingRateMap by_image(size, size);
+    frame = render(model, shadow_map, size, &by_image,
+                   [&](const auto &) { by_image.adapt(full.image); });
+    report("adaptive, previous frame", by_image, frame);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "model.h"
+#include "texture_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Checks the tangent frames against a normal map baked in both spaces: the normals of the tangent
+// space map, brought to object space through the interpolated frames of Model, must match the
+// object space map. Compared with frames made from the uv gradient of each face alone, which
+// ignore how the baker smoothed them across faces. Mirrored uv islands share texels that the
+// object space map can only hold for one side, so the mean has a long tail; the median and the
+// share of close matches are what tell the frames apart.
+
+const size_t samples = 8;  // per triangle edge
+
+vec3f decode(TGAColor c)
+{
+    vec3f res;
+    for (size_t i = 0; i < 3; i++) res[2 - i] = c[i] / 255. * 2 - 1;
+    return res;
+}
+
+// angles between the reconstructed and the baked object space normals, in degrees
+void report(const char *name, std::vector<double> angles)
+{
+    double sum = 0;
+    size_t within5 = 0;
+    for (double a : angles) {
+        sum += a;
+        within5 += a < 5;
+    }
+    auto median = angles.begin() + static_cast<std::ptrdiff_t>(angles.size() / 2);
+    std::nth_element(angles.begin(), median, angles.end());
+    double n = static_cast<double>(angles.size());
+    std::cout << name << ": median " << *median << " degrees, mean " << sum / n << ", "
+              << 100. * static_cast<double>(within5) / n << "% within 5 degrees" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string filename = argc > 1 ? argv[1] : "obj/diablo3_pose.obj";
+    Model model{filename, false, true};
+    std::string object_file = filename.substr(0, filename.find_last_of('.')) + "_nm.tga";
+    std::shared_ptr<const Texture> object_map = TextureCache::instance().load(object_file);
+    if (!object_map || model.normal_map()->empty()) return 1;
+
+    std::vector<double> frames, face_frames;
+    for (size_t f = 0; f < model.nfaces(); f++) {
+        // the uv gradient of the face alone, made orthogonal to each corner's normal
+        vec3f d1 = model.vert(f, 1) - model.vert(f, 0), d2 = model.vert(f, 2) - model.vert(f, 0);
+        vec2f t21 = model.uv(f, 1) - model.uv(f, 0), t31 = model.uv(f, 2) - model.uv(f, 0);
+        double area = t21.x * t31.y - t21.y * t31.x;
+        if (std::abs(area) < 1e-12) continue;
+        vec3f face_t = (d1 * t31.y - d2 * t21.y) / area;
+        for (size_t a = 0; a <= samples; a++)
+            for (size_t b = 0; a + b <= samples; b++) {
+                vec3f bar(static_cast<double>(a), static_cast<double>(b),
+                          static_cast<double>(samples - a - b));
+                bar = (bar + vec3f(1, 1, 1) / 3.) / (static_cast<double>(samples) + 1);
+                vec3f t(0, 0, 0), bt(0, 0, 0), n(0, 0, 0), ft(0, 0, 0), fb(0, 0, 0);
+                vec2f uv(0, 0);
+                for (size_t j = 0; j < 3; j++) {
+                    vec3f nj = model.normal(f, j);
+                    t = t + model.tangent(f, j) * bar[j];
+                    bt = bt + model.bitangent(f, j) * bar[j];
+                    n = n + nj * bar[j];
+                    vec3f tj = (face_t - nj * dot(nj, face_t)).normalize();
+                    ft = ft + tj * bar[j];
+                    fb = fb + cross(nj, tj) * ((area > 0 ? 1. : -1.) * bar[j]);
+                    uv = uv + model.uv(f, j) * bar[j];
+                }
+                vec3f expected = decode(object_map->sample(uv)).normalize();
+                vec3f m = model.normal(uv);
+                n.normalize();
+                auto check = [&](std::vector<double> &angles, vec3f tangent, vec3f bitangent) {
+                    vec3f got =
+                        (tangent.normalize() * m.x + bitangent.normalize() * m.y + n * m.z)
+                            .normalize();
+                    angles.push_back(std::acos(clamp(dot(got, expected), -1., 1.)) * 180 / M_PI);
+                };
+                check(frames, t, bt);
+                check(face_frames, ft, fb);
+            }
+    }
+    report("model tangent frames", frames);
+    report("per face uv gradients", face_frames);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "texture.h"
+#include "model.h"
+#include "texture_cache.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+const size_t samples = 1 << 20;
+
+using Clock = std::chrono::steady_clock;
+
+double ms_since(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// PSNR of the compressed level 0 against the source, over the channels the format keeps
+double psnr(const Texture &ref, const Texture &tex, BlockFormat format)
+{
+    std::vector<size_t> channels;
+    if (format == BlockFormat::BC1) channels = {0, 1, 2};
+    if (format == BlockFormat::BC4) channels = {0};
+    if (format == BlockFormat::BC5) channels = {1, 2};
+    double se = 0;
+    size_t n = 0;
+    for (size_t y = 0; y < ref.get_height(); y++)
+        for (size_t x = 0; x < ref.get_width(); x++) {
+            TGAColor a = ref.fetch(0, x, y), b = tex.fetch(0, x, y);
+            for (size_t c : channels) {
+                double d = a[c] - b[c];
+                se += d * d;
+                n++;
+            }
+        }
+    double mse = se / static_cast<double>(n);
+    return mse > 0 ? 10. * std::log10(255. * 255. / mse) : 99.;
+}
+
+// average cost of a trilinear sample at random uv and lod
+double sample_ns(const Texture &tex, const std::vector<vec3f> &uvl)
+{
+    unsigned checksum = 0;
+    auto start = Clock::now();
+    for (auto &p : uvl) checksum += tex.sample(vec2f(p.x, p.y), p.z)[0];
+    double ns = ms_since(start) * 1e6 / static_cast<double>(uvl.size());
+    if (checksum == 1) std::cout << "";  // keep the loop alive
+    return ns;
+}
+
+int main(int argc, char **argv)
+{
+    std::string base = argc > 1 ? argv[1] : "obj/diablo3_pose";
+    const std::pair<std::string, BlockFormat> maps[] = {{"_diffuse.tga", BlockFormat::BC1},
+                                                        {"_spec.tga", BlockFormat::BC4},
+                                                        {"_nm_tangent.tga", BlockFormat::BC5}};
+    const char *names[] = {"none", "BC1", "BC4", "BC5"};
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> unit(0., 1.), lod(0., 3.);
+    std::vector<vec3f> uvl(samples);
+    for (auto &p : uvl) p = vec3f(unit(rng), unit(rng), lod(rng));
+
+    for (auto &m : maps) {
+        TGAImage img;
+        if (!img.read_tga_file(base + m.first)) continue;
+        img.flip_vertically();
+        Texture ref(img);
+        auto start = Clock::now();
+        Texture tex(img, true, TextureLayout::RowMajor, m.second);
+        double encode_ms = ms_since(start);
+        ref.set_filter(TextureFilter::Trilinear);
+        tex.set_filter(TextureFilter::Trilinear);
+        double ratio =
+            static_cast<double>(ref.memory_bytes()) / static_cast<double>(tex.memory_bytes());
+        std::cout << m.first << " " << names[static_cast<int>(m.second)] << ": "
+                  << ref.memory_bytes() / 1024 << " KiB -> " << tex.memory_bytes() / 1024
+                  << " KiB (" << ratio << "x), PSNR " << psnr(ref, tex, m.second)
+                  << " dB, encode " << encode_ms << " ms, sample " << sample_ns(ref, uvl)
+                  << " ns -> " << sample_ns(tex, uvl) << " ns" << std::endl;
+    }
+
+    std::string obj = base + ".obj";
+    Model plain{obj, true, true, true};
+    Model compressed{obj, true, true, true, TextureLayout::RowMajor, TextureStorage::Compressed};
+    std::cout << "model texture memory: " << plain.texture_memory() / 1024 << " KiB -> "
+              << compressed.texture_memory() / 1024 << " KiB" << std::endl;
+
+    Model shared{obj, true, true, true};  // served from the texture cache
+    TextureCacheStats stats = TextureCache::instance().stats();
+    std::cout << "texture cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.entries << " entries, " << stats.resident_bytes / 1024 << " KiB resident"
+              << std::endl;
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "our_gl.h"
+#include "shaders.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+const size_t frames = 3;
+
+vec3f light_dir = vec3f(1, 1, 1).normalize();
+vec3f eye(1, 1, 3);
+vec3f center(0, 0, 0);
+vec3f up(0, 1, 0);
+
+// average time of the lesson-7 color pass, the shadow map is rendered once up front
+double render_ms(Model &model, int size)
+{
+    mat4 Viewport = viewport(size / 8, size / 8, size * 3 / 4, size * 3 / 4);
+    ShadowMap<> shadow_map(static_cast<size_t>(size), static_cast<size_t>(size));
+    shadow_map.fit(model, light_dir, up);
+    shadow_map.render(model);
+
+    mat4 ModelView = lookat(eye, center, up);
+    mat4 Projection = projection(-1. / (eye - center).norm());
+    double total = 0;
+    for (size_t f = 0; f < frames; f++) {
+        TGAImage image(static_cast<size_t>(size), static_cast<size_t>(size), TGAImage::RGB);
+        DepthBuffer zbuffer(static_cast<size_t>(size), static_cast<size_t>(size));
+        Shader shader = camera_shader(ModelView, Projection, Viewport, light_dir, shadow_map);
+        auto start = std::chrono::steady_clock::now();
+        std::array<vec4f, 3> screen_coords;
+        for (size_t i = 0; i < model.nfaces(); i++) {
+            for (size_t j = 0; j < 3; j++)
+                screen_coords[j] = shader.vertex(model, static_cast<int>(i), static_cast<int>(j));
+            triangle(model, screen_coords, shader, image, zbuffer);
+        }
+        total += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                     .count();
+    }
+    return total / frames;
+}
+
+int main(int argc, char **argv)
+{
+    std::string filename = argc > 1 ? argv[1] : "obj/diablo3_pose.obj";
+    const std::pair<TextureLayout, const char *> layouts[] = {
+        {TextureLayout::RowMajor, "row-major"},
+        {TextureLayout::Tiled4, "tiled 4x4"},
+        {TextureLayout::Tiled8, "tiled 8x8"},
+        {TextureLayout::Morton, "morton"}};
+    const std::pair<TextureFilter, const char *> filters[] = {
+        {TextureFilter::Nearest, "nearest"}, {TextureFilter::Trilinear, "trilinear"}};
+
+    for (auto &layout : layouts) {
+        Model model{filename, true, true, true, layout.first};
+        for (auto &filter : filters) {
+            model.set_texture_filter(filter.first);
+            for (int size : {1000, 250}) {
+                std::cout << layout.second << ", " << filter.second << ", " << size << "x" << size
+                          << ": " << render_ms(model, size) << " ms/frame" << std::endl;
+            }
+        }
+    }
+    return 0;
+}
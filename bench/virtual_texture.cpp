@@ -0,0 +1,125 @@
+#include "our_gl.h"
+#include "shaders.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+
+const size_t frames = 8;
+const size_t size = 800;
+
+vec3f light_dir = vec3f(1, 1, 1).normalize();
+vec3f center(0, 0, 0);
+vec3f up(0, 1, 0);
+
+// the lesson-7 shader of a camera at eye
+std::unique_ptr<Shader<DepthUnorm16>> make_shader(vec3f eye, const ShadowMap<> &shadow_map)
+{
+    int s = static_cast<int>(size);
+    mat4 ModelView = lookat(eye, center, up);
+    mat4 Projection = projection(-1. / (eye - center).norm());
+    mat4 Viewport = viewport(s / 8, s / 8, s * 3 / 4, s * 3 / 4);
+    return std::make_unique<Shader<DepthUnorm16>>(
+        camera_shader(ModelView, Projection, Viewport, light_dir, shadow_map));
+}
+
+// eye of the given frame of a quarter turn around the model
+vec3f orbit(size_t frame)
+{
+    double a = M_PI / 2 * static_cast<double>(frame) / frames;
+    return vec3f(3 * std::sin(a), 1, 3 * std::cos(a));
+}
+
+// renders the orbit with the textures paged through a cache of cache_tiles tiles per map,
+// one feedback pass per frame
+void orbit_frames(const std::string &filename, size_t cache_tiles, const ShadowMap<> &shadow_map)
+{
+    Model model{filename, true, true, true, TextureLayout::RowMajor, TextureStorage::Virtual};
+    model.set_texture_filter(TextureFilter::Bilinear);
+    model.set_paging_cache(cache_tiles);
+    std::cout << "cache of " << cache_tiles << " tiles per map" << std::endl;
+    TGAImage image(size, size, TGAImage::RGB);
+    DepthBuffer zbuffer(size, size);
+    VirtualTextureStats last;
+    for (size_t f = 0; f < frames; f++) {
+        image.clear();
+        zbuffer.clear();
+        std::unique_ptr<Shader<DepthUnorm16>> shader = make_shader(orbit(f), shadow_map);
+        auto start = std::chrono::steady_clock::now();
+        model.begin_frame();
+        std::array<vec4f, 3> pts;
+        for (size_t i = 0; i < model.nfaces(); i++) {
+            for (size_t j = 0; j < 3; j++)
+                pts[j] = shader->vertex(model, static_cast<int>(i), static_cast<int>(j));
+            triangle(model, pts, *shader, image, zbuffer);
+        }
+        model.end_frame();
+        double ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                .count();
+        VirtualTextureStats stats = model.paging_stats();
+        std::cout << "  frame " << f << ": " << ms << " ms, "
+                  << stats.page_faults - last.page_faults << " page faults, "
+                  << stats.prefetched - last.prefetched << " prefetched, "
+                  << stats.evictions - last.evictions << " evictions, " << stats.resident_tiles
+                  << "/" << stats.total_tiles << " tiles resident" << std::endl;
+        last = stats;
+    }
+}
+
+// several views sharing the paged maps from concurrent threads must match the views drawn one
+// after another
+void concurrent_views(const std::string &filename, size_t cache_tiles,
+                      const ShadowMap<> &shadow_map)
+{
+    std::vector<std::unique_ptr<Shader<DepthUnorm16>>> shaders;
+    for (size_t f = 0; f < frames; f += 2) shaders.push_back(make_shader(orbit(f), shadow_map));
+    std::vector<TGAImage> images[2];
+    for (size_t nthreads : {size_t{1}, size_t{4}}) {
+        Model model{filename, true, true, true, TextureLayout::RowMajor, TextureStorage::Virtual};
+        model.set_texture_filter(TextureFilter::Bilinear);
+        model.set_paging_cache(cache_tiles);
+        std::vector<TGAImage> &out = images[nthreads > 1];
+        std::vector<DepthBuffer<DepthFloat64>> zbuffers;
+        for (size_t v = 0; v < shaders.size(); v++) {
+            out.emplace_back(size, size, TGAImage::RGB);
+            zbuffers.emplace_back(size, size);
+        }
+        std::vector<ViewTarget<DepthFloat64>> views;
+        for (size_t v = 0; v < shaders.size(); v++)
+            views.push_back({shaders[v].get(), &out[v], &zbuffers[v]});
+        model.begin_frame();
+        multiview_draw(model, views, nthreads);
+        model.end_frame();
+        VirtualTextureStats stats = model.paging_stats();
+        std::cout << shaders.size() << " views on " << nthreads << " threads: "
+                  << stats.page_faults << " page faults, " << stats.evictions << " evictions";
+        if (nthreads > 1) {
+            size_t differing = 0;
+            for (size_t v = 0; v < out.size(); v++)
+                for (size_t y = 0; y < size; y++)
+                    for (size_t x = 0; x < size; x++) {
+                        TGAColor a = out[v].get(x, y), b = images[0][v].get(x, y);
+                        differing += a[0] != b[0] || a[1] != b[1] || a[2] != b[2];
+                    }
+            std::cout << " (" << differing << " pixels differ)";
+        }
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string filename = argc > 1 ? argv[1] : "obj/diablo3_pose.obj";
+    Model model{filename};
+    ShadowMap<> shadow_map(1024, 1024);
+    shadow_map.fit(model, light_dir, up);
+    shadow_map.render(model);
+
+    for (size_t cache_tiles : {size_t{64}, size_t{32}})
+        orbit_frames(filename, cache_tiles, shadow_map);
+    concurrent_views(filename, 32, shadow_map);
+    return 0;
+}
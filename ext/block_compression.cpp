@@ -0,0 +1,214 @@
+#include "block_compression.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "geometry.h"
+
+namespace {
+
+std::uint16_t pack565(const double bgr[3])
+{
+    auto q = [](double v, unsigned bits) {
+        double levels = static_cast<double>((1u << bits) - 1);
+        return static_cast<unsigned>(clamp(v / 255., 0., 1.) * levels + .5);
+    };
+    return static_cast<std::uint16_t>((q(bgr[2], 5) << 11) | (q(bgr[1], 6) << 5) | q(bgr[0], 5));
+}
+
+void unpack565(std::uint16_t c, int bgr[3])
+{
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    bgr[2] = (r << 3) | (r >> 2);
+    bgr[1] = (g << 2) | (g >> 4);
+    bgr[0] = (b << 3) | (b >> 2);
+}
+
+void put16(std::uint8_t *out, std::uint16_t v)
+{
+    out[0] = static_cast<std::uint8_t>(v & 0xff);
+    out[1] = static_cast<std::uint8_t>(v >> 8);
+}
+
+std::uint16_t get16(const std::uint8_t *in)
+{
+    return static_cast<std::uint16_t>(in[0] | (in[1] << 8));
+}
+
+// Endpoints along the principal axis of the block colors, then every texel picks the closest of
+// the four palette entries.
+void encode_bc1(const TGAColor texels[16], std::uint8_t *out)
+{
+    double mean[3] = {0, 0, 0};
+    for (size_t i = 0; i < 16; i++)
+        for (size_t c = 0; c < 3; c++) mean[c] += texels[i].bgra[c] / 16.;
+    double cov[3][3] = {};
+    for (size_t i = 0; i < 16; i++)
+        for (size_t a = 0; a < 3; a++)
+            for (size_t b = 0; b < 3; b++)
+                cov[a][b] += (texels[i].bgra[a] - mean[a]) * (texels[i].bgra[b] - mean[b]);
+    double axis[3] = {1, 1, 1};
+    for (int iter = 0; iter < 8; iter++) {  // power iteration
+        double next[3] = {0, 0, 0};
+        for (size_t a = 0; a < 3; a++)
+            for (size_t b = 0; b < 3; b++) next[a] += cov[a][b] * axis[b];
+        double len = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+        if (len < 1e-9) break;
+        for (size_t a = 0; a < 3; a++) axis[a] = next[a] / len;
+    }
+    double tmin = 0, tmax = 0;
+    for (size_t i = 0; i < 16; i++) {
+        double t = 0;
+        for (size_t c = 0; c < 3; c++) t += (texels[i].bgra[c] - mean[c]) * axis[c];
+        tmin = std::min(tmin, t);
+        tmax = std::max(tmax, t);
+    }
+    double hi[3], lo[3];
+    for (size_t c = 0; c < 3; c++) {
+        hi[c] = mean[c] + tmax * axis[c];
+        lo[c] = mean[c] + tmin * axis[c];
+    }
+    std::uint16_t c0 = pack565(hi), c1 = pack565(lo);
+    if (c0 < c1) std::swap(c0, c1);
+    put16(out, c0);
+    put16(out + 2, c1);
+
+    int palette[4][3];
+    unpack565(c0, palette[0]);
+    unpack565(c1, palette[1]);
+    for (size_t c = 0; c < 3; c++) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+    std::uint32_t indices = 0;
+    if (c0 != c1) {
+        for (size_t i = 0; i < 16; i++) {
+            int best = 0, best_err = 1 << 30;
+            for (int p = 0; p < 4; p++) {
+                int err = 0;
+                for (size_t c = 0; c < 3; c++) {
+                    int d = texels[i].bgra[c] - palette[p][c];
+                    err += d * d;
+                }
+                if (err < best_err) best = p, best_err = err;
+            }
+            indices |= static_cast<std::uint32_t>(best) << (2 * i);
+        }
+    }
+    for (size_t b = 0; b < 4; b++) out[4 + b] = static_cast<std::uint8_t>(indices >> (8 * b));
+}
+
+TGAColor decode_bc1(const std::uint8_t *block, size_t i)
+{
+    std::uint16_t c0 = get16(block), c1 = get16(block + 2);
+    size_t index = (block[4 + i / 4] >> (2 * (i % 4))) & 3;
+    int e0[3], e1[3], bgr[3];
+    unpack565(c0, e0);
+    unpack565(c1, e1);
+    for (size_t c = 0; c < 3; c++) {
+        switch (index) {
+            case 0: bgr[c] = e0[c]; break;
+            case 1: bgr[c] = e1[c]; break;
+            case 2: bgr[c] = c0 > c1 ? (2 * e0[c] + e1[c]) / 3 : (e0[c] + e1[c]) / 2; break;
+            default: bgr[c] = c0 > c1 ? (e0[c] + 2 * e1[c]) / 3 : 0; break;
+        }
+    }
+    return TGAColor(static_cast<std::uint8_t>(bgr[2]), static_cast<std::uint8_t>(bgr[1]),
+                    static_cast<std::uint8_t>(bgr[0]));
+}
+
+int bc4_value(int e0, int e1, size_t index)
+{
+    if (index == 0) return e0;
+    if (index == 1) return e1;
+    int i = static_cast<int>(index);
+    if (e0 > e1) return ((8 - i) * e0 + (i - 1) * e1) / 7;
+    if (index == 6) return 0;
+    if (index == 7) return 255;
+    return ((6 - i) * e0 + (i - 1) * e1) / 5;
+}
+
+void encode_bc4(const TGAColor texels[16], size_t channel, std::uint8_t *out)
+{
+    int e0 = 0, e1 = 255;
+    for (size_t i = 0; i < 16; i++) {
+        e0 = std::max(e0, static_cast<int>(texels[i].bgra[channel]));
+        e1 = std::min(e1, static_cast<int>(texels[i].bgra[channel]));
+    }
+    out[0] = static_cast<std::uint8_t>(e0);
+    out[1] = static_cast<std::uint8_t>(e1);
+    std::uint64_t indices = 0;
+    if (e0 != e1) {
+        for (size_t i = 0; i < 16; i++) {
+            size_t best = 0;
+            int best_err = 1 << 30;
+            for (size_t p = 0; p < 8; p++) {
+                int err = std::abs(texels[i].bgra[channel] - bc4_value(e0, e1, p));
+                if (err < best_err) best = p, best_err = err;
+            }
+            indices |= static_cast<std::uint64_t>(best) << (3 * i);
+        }
+    }
+    for (size_t b = 0; b < 6; b++) out[2 + b] = static_cast<std::uint8_t>(indices >> (8 * b));
+}
+
+std::uint8_t decode_bc4(const std::uint8_t *block, size_t i)
+{
+    std::uint64_t indices = 0;
+    for (size_t b = 0; b < 6; b++) indices |= static_cast<std::uint64_t>(block[2 + b]) << (8 * b);
+    size_t index = static_cast<size_t>((indices >> (3 * i)) & 7);
+    return static_cast<std::uint8_t>(bc4_value(block[0], block[1], index));
+}
+
+}  // namespace
+
+size_t block_bytes(BlockFormat format)
+{
+    switch (format) {
+        case BlockFormat::None: return 0;
+        case BlockFormat::BC1: return 8;
+        case BlockFormat::BC4: return 8;
+        case BlockFormat::BC5: return 16;
+    }
+    return 0;
+}
+
+size_t block_channels(BlockFormat format)
+{
+    switch (format) {
+        case BlockFormat::None: return 0;
+        case BlockFormat::BC1: return 3;
+        case BlockFormat::BC4: return 1;
+        case BlockFormat::BC5: return 3;
+    }
+    return 0;
+}
+
+void encode_block(BlockFormat format, const TGAColor texels[16], std::uint8_t *out)
+{
+    switch (format) {
+        case BlockFormat::None: break;
+        case BlockFormat::BC1: encode_bc1(texels, out); break;
+        case BlockFormat::BC4: encode_bc4(texels, 0, out); break;
+        case BlockFormat::BC5:
+            encode_bc4(texels, 2, out);
+            encode_bc4(texels, 1, out + 8);
+            break;
+    }
+}
+
+TGAColor decode_texel(BlockFormat format, const std::uint8_t *block, size_t i)
+{
+    switch (format) {
+        case BlockFormat::None: break;
+        case BlockFormat::BC1: return decode_bc1(block, i);
+        case BlockFormat::BC4: return TGAColor(decode_bc4(block, i));
+        case BlockFormat::BC5: {
+            std::uint8_t r = decode_bc4(block, i), g = decode_bc4(block + 8, i);
+            double x = r / 255. * 2 - 1, y = g / 255. * 2 - 1;
+            double z = std::sqrt(std::max(0., 1. - x * x - y * y));
+            return TGAColor(r, g, static_cast<std::uint8_t>((z + 1) * .5 * 255. + .5));
+        }
+    }
+    return {};
+}
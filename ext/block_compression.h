@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "tgaimage.h"
+
+// Block compression of 4x4 texel blocks in the layout of the BCn GPU formats. Texels inside a
+// block are numbered row by row, i = x + 4 * y.
+//   BC1: 8 bytes, two RGB565 endpoints and 2 bit indices                 (RGB, 6:1 against RGB8)
+//   BC4: 8 bytes, two 8 bit endpoints and 3 bit indices for one channel  (6:1 against RGB8)
+//   BC5: 16 bytes, two BC4 blocks for the x and y of a unit vector       (3:1 against RGB8)
+enum class BlockFormat
+{
+    None,
+    BC1,
+    BC4,
+    BC5
+};
+
+size_t block_bytes(BlockFormat format);
+
+// number of channels a decoded texel has
+size_t block_channels(BlockFormat format);
+
+// texels are in TGAColor bgra order; BC4 compresses channel 0, BC5 channels 2 and 1 (x and y)
+void encode_block(BlockFormat format, const TGAColor texels[16], std::uint8_t *out);
+
+// BC5 reconstructs channel 0 (z) from the other two, assuming a unit vector with z >= 0
+TGAColor decode_texel(BlockFormat format, const std::uint8_t *block, size_t i);
@@ -1,14 +1,84 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <future>
+#include <atomic>
+#include <array>
+#include <map>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <limits>
 #include "model.h"
+#include "texture_cache.h"
+#include "parallel.h"
+
+Model::Model(TextureLayout layout, TextureStorage storage) : layout_(layout), storage_(storage)
+{
+    diffusemap_.texture = std::make_shared<const Texture>();
+    normalmap_.texture = specularmap_.texture = diffusemap_.texture;
+}
 
 Model::Model(const std::string filename, bool diffuse_texture, bool normal_map,
-             bool specular_texture)
+             bool specular_texture, TextureLayout layout, TextureStorage storage)
+    : Model(layout, storage)
+{
+    if (!load_geometry(filename)) return;
+    if (diffuse_texture) load_texture(filename, "_diffuse.tga", diffusemap_, BlockFormat::BC1);
+    if (normal_map) load_texture(filename, "_nm_tangent.tga", normalmap_, BlockFormat::BC5);
+    if (specular_texture) load_texture(filename, "_spec.tga", specularmap_, BlockFormat::BC4);
+}
+
+ModelLoad Model::load_async(const std::string filename, bool diffuse_texture, bool normal_map,
+                            bool specular_texture, TextureLayout layout, TextureStorage storage)
+{
+    ModelLoad ret;
+    ret.model = std::shared_ptr<Model>(new Model(layout, storage));
+    std::shared_ptr<Model> m = ret.model;
+    // the parse and every texture decode run as tasks of the thread pool; each task only writes
+    // its own members of the model and keeps the model alive, the last texture task to finish
+    // completes the textures future
+    ThreadPool &pool = ThreadPool::instance();
+    ret.geometry = pool.submit([m, filename]() { return m->load_geometry(filename); }).share();
+    struct Pending
+    {
+        std::atomic<size_t> count{1};  // one held until every texture task is queued
+        std::promise<void> done;
+    };
+    auto pending = std::make_shared<Pending>();
+    ret.textures = pending->done.get_future().share();
+    auto finish = [pending]() {
+        if (--pending->count == 0) pending->done.set_value();
+    };
+    auto start = [&](bool wanted, const char *suffix, TextureMap &map, BlockFormat format) {
+        if (!wanted) return;
+        pending->count++;
+        pool.submit([m, filename, suffix, &map, format, finish]() {
+            m->load_texture(filename, suffix, map, format);
+            finish();
+        });
+    };
+    start(diffuse_texture, "_diffuse.tga", m->diffusemap_, BlockFormat::BC1);
+    start(normal_map, "_nm_tangent.tga", m->normalmap_, BlockFormat::BC5);
+    start(specular_texture, "_spec.tga", m->specularmap_, BlockFormat::BC4);
+    finish();
+    return ret;
+}
+
+bool ModelLoad::wait() const
+{
+    textures.wait();
+    return geometry.get();
+}
+
+bool Model::load_geometry(const std::string filename)
 {
     std::ifstream in;
     in.open(filename, std::ifstream::in);
-    if (in.fail()) return;
+    if (in.fail()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
     std::string line;
     while (!in.eof()) {
         std::getline(in, line);
@@ -42,16 +112,15 @@ Model::Model(const std::string filename, bool diffuse_texture, bool normal_map,
             if (3 != cnt) {
                 std::cerr << "Error: the obj file is supposed to be triangulated" << std::endl;
                 in.close();
-                return;
+                return false;
             }
         }
     }
     in.close();
+    compute_tangents();
     std::cerr << "# v# " << nverts() << " f# " << nfaces() << " vt# " << uv_.size() << " vn# "
               << norms_.size() << std::endl;
-    if (diffuse_texture) load_texture(filename, "_diffuse.tga", diffusemap_);
-    if (normal_map) load_texture(filename, "_nm_tangent.tga", normalmap_);
-    if (specular_texture) load_texture(filename, "_spec.tga", specularmap_);
+    return true;
 }
 
 size_t Model::nverts() const { return verts_.size(); }
@@ -62,46 +131,321 @@ vec3f Model::vert(const size_t i) const { return verts_[i]; }
 
 vec3f Model::vert(const size_t iface, const size_t nthvert) const
 {
-    return verts_[facet_vrt_[iface * 3 + nthvert]];
+    return verts_[static_cast<size_t>(facet_vrt_[iface * 3 + nthvert])];
 }
 
-void Model::load_texture(std::string filename, const std::string suffix, TGAImage &img)
+// Tangent frames computed the way MikkTSpace (mikktspace.c, the reference most bakers use)
+// computes them, so tangent space normal maps baked against it shade as baked:
+// - corners with equal position, normal and uv are welded into one vertex, and a triangle with
+//   two corners on the same vertex is degenerate;
+// - every triangle gets the unit directions of increasing u and v, flipped when its uv mapping
+//   mirrors, which also gives its orientation; triangles without a usable uv gradient are
+//   marked to group with any orientation;
+// - around every vertex, triangles that reach each other across shared edges and have the same
+//   orientation form a group; the groups are then split into subgroups of the triangles whose
+//   directions, projected onto the vertex normal's plane, aren't opposite;
+// - a subgroup's tangent is the sum of its projected directions, weighted by the corner angles
+//   in that plane. The sign is the orientation of the group, the bitangent is sign * cross(n, t);
+// - degenerate triangles take the frame of a corner on the same vertex of a proper triangle.
+// Only triangles are handled, quads were split when the obj was loaded.
+void Model::compute_tangents()
+{
+    const double tiny = std::numeric_limits<float>::min();  // mikktspace's NotZero()
+    const size_t ncorners = facet_vrt_.size(), nf = nfaces();
+    // welded vertex of every corner
+    std::vector<size_t> vertex(ncorners);
+    std::map<std::array<double, 8>, size_t> welded;
+    for (size_t c = 0; c < ncorners; c++) {
+        vec3f p = vert(c / 3, c % 3), n = normal(c / 3, c % 3);
+        vec2f t = uv(c / 3, c % 3);
+        std::array<double, 8> key = {p.x, p.y, p.z, n.x, n.y, n.z, t.x, t.y};
+        vertex[c] = welded.emplace(key, welded.size()).first->second;
+    }
+
+    struct Face
+    {
+        vec3f os, ot;  // unit directions of increasing u and v, times the orientation
+        bool preserving = false, any = true, degenerate = false;
+        int neighbor[3] = {-1, -1, -1};  // across the edge from corner i to corner i + 1
+        int group[3] = {-1, -1, -1};     // of each corner
+    };
+    std::vector<Face> faces(nf);
+    for (size_t f = 0; f < nf; f++) {
+        Face &face = faces[f];
+        const size_t *v = &vertex[f * 3];
+        face.degenerate = v[0] == v[1] || v[0] == v[2] || v[1] == v[2];
+        vec3f d1 = vert(f, 1) - vert(f, 0), d2 = vert(f, 2) - vert(f, 0);
+        vec2f t21 = uv(f, 1) - uv(f, 0), t31 = uv(f, 2) - uv(f, 0);
+        double area = t21.x * t31.y - t21.y * t31.x;  // signed, doubled
+        face.os = d1 * t31.y - d2 * t21.y;
+        face.ot = d2 * t21.x - d1 * t31.x;
+        face.preserving = area > 0;
+        if (std::abs(area) > tiny) {
+            double sign = face.preserving ? 1. : -1.;
+            double len_s = face.os.norm(), len_t = face.ot.norm();
+            if (len_s > tiny) face.os = face.os * (sign / len_s);
+            if (len_t > tiny) face.ot = face.ot * (sign / len_t);
+            face.any = !(len_s / std::abs(area) > tiny && len_t / std::abs(area) > tiny);
+        }
+    }
+
+    // neighbors across edges walked in opposite directions, between proper triangles
+    std::multimap<std::pair<size_t, size_t>, size_t> edges;  // (from, to) -> face * 3 + edge
+    for (size_t f = 0; f < nf; f++)
+        if (!faces[f].degenerate)
+            for (size_t i = 0; i < 3; i++)
+                edges.emplace(std::make_pair(vertex[f * 3 + i], vertex[f * 3 + (i + 1) % 3]),
+                              f * 3 + i);
+    for (size_t f = 0; f < nf; f++) {
+        if (faces[f].degenerate) continue;
+        for (size_t i = 0; i < 3; i++) {
+            if (faces[f].neighbor[i] >= 0) continue;
+            auto range = edges.equal_range(
+                std::make_pair(vertex[f * 3 + (i + 1) % 3], vertex[f * 3 + i]));
+            for (auto it = range.first; it != range.second; ++it) {
+                size_t g = it->second / 3, j = it->second % 3;
+                if (g == f || faces[g].neighbor[j] >= 0) continue;
+                faces[f].neighbor[i] = static_cast<int>(g);
+                faces[g].neighbor[j] = static_cast<int>(f);
+                break;
+            }
+        }
+    }
+
+    struct Group
+    {
+        size_t vertex;
+        bool preserving;
+        std::vector<size_t> faces;
+    };
+    std::vector<Group> groups;
+    auto corner_of = [&](size_t f, size_t v) {
+        size_t i = 0;
+        while (i < 2 && vertex[f * 3 + i] != v) i++;
+        return i;
+    };
+    // the triangles around a group's vertex that reach each other across shared edges
+    std::function<void(size_t, int)> assign = [&](size_t f, int g) {
+        Face &face = faces[f];
+        size_t i = corner_of(f, groups[static_cast<size_t>(g)].vertex);
+        if (face.group[i] >= 0) return;
+        if (face.any && face.group[0] < 0 && face.group[1] < 0 && face.group[2] < 0)
+            face.preserving = groups[static_cast<size_t>(g)].preserving;
+        if (face.preserving != groups[static_cast<size_t>(g)].preserving) return;
+        groups[static_cast<size_t>(g)].faces.push_back(f);
+        face.group[i] = g;
+        for (int n : {face.neighbor[i], face.neighbor[(i + 2) % 3]})
+            if (n >= 0) assign(static_cast<size_t>(n), g);
+    };
+    for (size_t f = 0; f < nf; f++) {
+        if (faces[f].degenerate || faces[f].any) continue;
+        for (size_t i = 0; i < 3; i++) {
+            if (faces[f].group[i] >= 0) continue;
+            int g = static_cast<int>(groups.size());
+            groups.push_back({vertex[f * 3 + i], faces[f].preserving, {f}});
+            faces[f].group[i] = g;
+            for (int n : {faces[f].neighbor[i], faces[f].neighbor[(i + 2) % 3]})
+                if (n >= 0) assign(static_cast<size_t>(n), g);
+        }
+    }
+
+    // os or ot of face f in the plane of the normal n, unit length unless it vanishes
+    auto project = [&](vec3f d, const vec3f &n) {
+        d = d - n * dot(n, d);
+        double len = d.norm();
+        return len > tiny ? d / len : d;
+    };
+    tangents_.assign(ncorners, vec4f{1, 0, 0, -1});  // mikktspace's default frame
+    std::vector<bool> done(ncorners, false);
+    for (const Group &group : groups) {
+        std::vector<std::vector<size_t>> subgroups;
+        std::vector<vec3f> subgroup_tangents;
+        for (size_t f : group.faces) {
+            size_t i = corner_of(f, group.vertex);
+            vec3f n = normal(f, i);
+            vec3f os = project(faces[f].os, n), ot = project(faces[f].ot, n);
+            std::vector<size_t> members;
+            for (size_t t : group.faces) {
+                vec3f os2 = project(faces[t].os, n), ot2 = project(faces[t].ot, n);
+                if (faces[f].any || faces[t].any || t == f ||
+                    (dot(os, os2) > -1 && dot(ot, ot2) > -1))
+                    members.push_back(t);
+            }
+            std::sort(members.begin(), members.end());
+            size_t s = 0;
+            while (s < subgroups.size() && subgroups[s] != members) s++;
+            if (s == subgroups.size()) {
+                vec3f sum(0, 0, 0);
+                for (size_t t : members) {
+                    if (faces[t].any) continue;
+                    size_t k = corner_of(t, group.vertex);
+                    vec3f nk = normal(t, k);
+                    vec3f e1 = project(vert(t, (k + 2) % 3) - vert(t, k), nk);
+                    vec3f e2 = project(vert(t, (k + 1) % 3) - vert(t, k), nk);
+                    double angle = std::acos(clamp(dot(e1, e2), -1., 1.));
+                    sum = sum + project(faces[t].os, nk) * angle;
+                }
+                double len = sum.norm();
+                subgroups.push_back(members);
+                subgroup_tangents.push_back(len > tiny ? sum / len : sum);
+            }
+            vec3f t = subgroup_tangents[s];
+            tangents_[f * 3 + i] = vec4f{t.x, t.y, t.z, group.preserving ? 1. : -1.};
+            done[f * 3 + i] = true;
+        }
+    }
+    // degenerate triangles take the frame of a proper corner on the same vertex
+    std::vector<int> frame_of(welded.size(), -1);
+    for (size_t c = 0; c < ncorners; c++)
+        if (done[c] && frame_of[vertex[c]] < 0) frame_of[vertex[c]] = static_cast<int>(c);
+    for (size_t f = 0; f < nf; f++)
+        if (faces[f].degenerate)
+            for (size_t c = f * 3; c < f * 3 + 3; c++)
+                if (frame_of[vertex[c]] >= 0)
+                    tangents_[c] = tangents_[static_cast<size_t>(frame_of[vertex[c]])];
+}
+
+void Model::load_texture(std::string filename, const std::string suffix, TextureMap &map,
+                         BlockFormat format)
 {
     size_t dot = filename.find_last_of(".");
     if (dot == std::string::npos) return;
     std::string texfile = filename.substr(0, dot) + suffix;
-    std::cerr << "texture file " << texfile << " loading "
-              << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-    img.flip_vertically();
+    bool ok = false;
+    if (storage_ == TextureStorage::Virtual) {
+        auto paged = std::make_shared<VirtualTexture>(texfile);
+        if ((ok = !paged->empty())) map.paged = paged;
+    } else {
+        auto loaded = TextureCache::instance().load(
+            texfile, layout_, storage_ == TextureStorage::Compressed ? format : BlockFormat::None);
+        if ((ok = loaded != nullptr)) map.texture = loaded;
+    }
+    std::cerr << "texture file " << texfile << " loading " << (ok ? "ok" : "failed") << std::endl;
 }
 
-TGAColor Model::diffuse(const vec2f &uvf) const
+TGAColor Model::TextureMap::sample(const vec2f &uv, TextureFilter filter) const
 {
-    return diffusemap_.get(static_cast<size_t>(uvf[0] * diffusemap_.get_width()),
-                           static_cast<size_t>(uvf[1] * diffusemap_.get_height()));
+    if (paged) return paged->sample(uv, filter != TextureFilter::Nearest);
+    return texture->sample(uv, 0., filter);
 }
 
-vec3f Model::normal(const vec2f &uvf) const
+TGAColor Model::TextureMap::sample(const vec2f &uv, const vec2f &duvdx, const vec2f &duvdy,
+                                   TextureFilter filter) const
+{
+    if (paged) return paged->sample(uv, filter != TextureFilter::Nearest);
+    return texture->sample(uv, texture->lod(duvdx, duvdy), filter);
+}
+
+size_t Model::TextureMap::memory_bytes() const
+{
+    return paged ? paged->memory_bytes() : texture->memory_bytes();
+}
+
+void Model::set_texture_filter(TextureFilter filter) { filter_ = filter; }
+
+void Model::set_normal_encoding(NormalEncoding encoding)
+{
+    normals_.reset();
+    if (encoding == NormalEncoding::Rgb8 || normalmap_.paged || normalmap_.texture->empty())
+        return;
+    normals_ = std::make_shared<const NormalMap>(*normalmap_.texture, encoding);
+}
+
+size_t Model::texture_memory() const
+{
+    return diffusemap_.memory_bytes() + normalmap_.memory_bytes() + specularmap_.memory_bytes() +
+           (normals_ ? normals_->memory_bytes() : 0);
+}
+
+std::shared_ptr<const Texture> Model::diffuse_map() const { return diffusemap_.texture; }
+
+std::shared_ptr<const Texture> Model::normal_map() const { return normalmap_.texture; }
+
+std::shared_ptr<const Texture> Model::specular_map() const { return specularmap_.texture; }
+
+void Model::begin_frame()
+{
+    for (TextureMap *map : {&diffusemap_, &normalmap_, &specularmap_})
+        if (map->paged) map->paged->begin_frame();
+}
+
+void Model::end_frame()
+{
+    for (TextureMap *map : {&diffusemap_, &normalmap_, &specularmap_})
+        if (map->paged) map->paged->end_frame();
+}
+
+void Model::set_paging_cache(size_t tiles)
+{
+    for (TextureMap *map : {&diffusemap_, &normalmap_, &specularmap_})
+        if (map->paged) map->paged->set_cache_tiles(tiles);
+}
+
+VirtualTextureStats Model::paging_stats() const
+{
+    VirtualTextureStats ret;
+    for (const TextureMap *map : {&diffusemap_, &normalmap_, &specularmap_}) {
+        if (!map->paged) continue;
+        VirtualTextureStats s = map->paged->stats();
+        ret.page_faults += s.page_faults;
+        ret.prefetched += s.prefetched;
+        ret.evictions += s.evictions;
+        ret.resident_tiles += s.resident_tiles;
+        ret.total_tiles += s.total_tiles;
+    }
+    return ret;
+}
+
+static vec3f decode_normal(TGAColor c)
 {
-    TGAColor c = normalmap_.get(static_cast<size_t>(uvf[0] * normalmap_.get_width()),
-                                static_cast<size_t>(uvf[1] * normalmap_.get_height()));
     vec3f res;
     for (size_t i = 0; i < 3; i++) res[2 - i] = c[i] / 255. * 2 - 1;
     return res;
 }
 
-double Model::specular(const vec2f &uvf) const
+TGAColor Model::diffuse(const vec2f &uvf) const { return diffusemap_.sample(uvf, filter_); }
+
+vec3f Model::normal(const vec2f &uvf) const
+{
+    if (normals_) return normals_->sample(uvf, 0., filter_);
+    return decode_normal(normalmap_.sample(uvf, filter_));
+}
+
+double Model::specular(const vec2f &uvf) const { return specularmap_.sample(uvf, filter_)[0]; }
+
+TGAColor Model::diffuse(const vec2f &uvf, const vec2f &duvdx, const vec2f &duvdy) const
+{
+    return diffusemap_.sample(uvf, duvdx, duvdy, filter_);
+}
+
+vec3f Model::normal(const vec2f &uvf, const vec2f &duvdx, const vec2f &duvdy) const
 {
-    return specularmap_.get(static_cast<size_t>(uvf[0] * specularmap_.get_width()),
-                            static_cast<size_t>(uvf[1] * specularmap_.get_height()))[0];
+    if (normals_) return normals_->sample(uvf, normals_->lod(duvdx, duvdy), filter_);
+    return decode_normal(normalmap_.sample(uvf, duvdx, duvdy, filter_));
+}
+
+double Model::specular(const vec2f &uvf, const vec2f &duvdx, const vec2f &duvdy) const
+{
+    return specularmap_.sample(uvf, duvdx, duvdy, filter_)[0];
 }
 
 vec2f Model::uv(const size_t iface, const size_t nthvert) const
 {
-    return uv_[facet_tex_[iface * 3 + nthvert]];
+    return uv_[static_cast<size_t>(facet_tex_[iface * 3 + nthvert])];
 }
 
 vec3f Model::normal(const size_t iface, const size_t nthvert) const
 {
-    return norms_[facet_nrm_[iface * 3 + nthvert]];
+    return norms_[static_cast<size_t>(facet_nrm_[iface * 3 + nthvert])];
+}
+
+vec3f Model::tangent(const size_t iface, const size_t nthvert) const
+{
+    return proj<3>(tangents_[iface * 3 + nthvert]);
+}
+
+vec3f Model::bitangent(const size_t iface, const size_t nthvert) const
+{
+    return cross(normal(iface, nthvert), tangent(iface, nthvert)) *
+           tangents_[iface * 3 + nthvert][3];
 }
\ No newline at end of file
@@ -1,8 +1,33 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <memory>
+#include <future>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
+#include "normal_map.h"
+#include "virtual_texture.h"
+
+class Model;
+
+enum class TextureStorage
+{
+    Resident,    // decoded and mip mapped at load time, shared through the TextureCache
+    Compressed,  // as Resident, block compressed (BC1 diffuse, BC5 normals, BC4 specular)
+    Virtual      // demand paged tiles of the finest level, decoded on first lookup
+};
+
+// Handle to a model that is loaded in the background. The geometry is safe to read (verts, uvs,
+// normals, faces) once geometry is ready, and holds false if the obj file couldn't be read; the
+// texture lookups are only safe after textures is ready.
+struct ModelLoad
+{
+    std::shared_ptr<Model> model;
+    std::shared_future<bool> geometry;
+    std::shared_future<void> textures;
+    bool wait() const;  // for both, false if the geometry failed to load
+};
 
 class Model
 {
@@ -13,22 +38,69 @@ private:
     std::vector<int> facet_vrt_;
     std::vector<int> facet_tex_;  // indices in the above arrays per triangle
     std::vector<int> facet_nrm_;
-    TGAImage diffusemap_;   // diffuse color texture
-    TGAImage normalmap_;    // normal map texture
-    TGAImage specularmap_;  // specular map texture
-    void load_texture(const std::string filename, const std::string suffix, TGAImage &img);
+    std::vector<vec4f> tangents_;  // per triangle corner: tangent, w is the bitangent sign
+    struct TextureMap
+    {
+        std::shared_ptr<const Texture> texture;  // resident texture
+        std::shared_ptr<VirtualTexture> paged;   // set instead of texture for Virtual storage
+        TGAColor sample(const vec2f &uv, TextureFilter filter) const;
+        TGAColor sample(const vec2f &uv, const vec2f &duvdx, const vec2f &duvdy,
+                        TextureFilter filter) const;
+        size_t memory_bytes() const;
+    };
+    TextureMap diffusemap_;   // diffuse color texture
+    TextureMap normalmap_;    // normal map texture
+    TextureMap specularmap_;  // specular map texture
+    std::shared_ptr<const NormalMap> normals_;  // pre-decoded normal map, if any
+    TextureLayout layout_;    // texel order the maps are converted to when they are loaded
+    TextureStorage storage_;
+    TextureFilter filter_ = TextureFilter::Nearest;
+    Model(TextureLayout layout, TextureStorage storage);
+    bool load_geometry(const std::string filename);
+    void compute_tangents();
+    void load_texture(const std::string filename, const std::string suffix, TextureMap &map,
+                      BlockFormat format);
 
 public:
     Model(const std::string filename, bool diffuse_texture = false, bool normal_map = false,
-          bool specular_texture = false);
+          bool specular_texture = false, TextureLayout layout = TextureLayout::RowMajor,
+          TextureStorage storage = TextureStorage::Resident);
+    // parses the obj file and decodes every requested texture concurrently
+    static ModelLoad load_async(const std::string filename, bool diffuse_texture = false,
+                                bool normal_map = false, bool specular_texture = false,
+                                TextureLayout layout = TextureLayout::RowMajor,
+                                TextureStorage storage = TextureStorage::Resident);
     size_t nverts() const;
     size_t nfaces() const;
     vec3f normal(const size_t iface,
                  const size_t nthvert) const;  // per triangle corner normal vertex
     vec3f normal(const vec2f &uv) const;  // fetch the normal vector from the normal map texture
+    // per triangle corner tangent frame of the uv mapping, orthogonal to normal(iface, nthvert)
+    vec3f tangent(const size_t iface, const size_t nthvert) const;
+    vec3f bitangent(const size_t iface, const size_t nthvert) const;
     vec3f vert(const size_t i) const;
     vec3f vert(const size_t iface, const size_t nthvert) const;
     vec2f uv(const size_t iface, const size_t nthvert) const;
     TGAColor diffuse(const vec2f &uv) const;
     double specular(const vec2f &uv) const;
+    // filtered lookups, the mip level is chosen from the screen space uv derivatives
+    vec3f normal(const vec2f &uv, const vec2f &duvdx, const vec2f &duvdy) const;
+    TGAColor diffuse(const vec2f &uv, const vec2f &duvdx, const vec2f &duvdy) const;
+    double specular(const vec2f &uv, const vec2f &duvdx, const vec2f &duvdy) const;
+    void set_texture_filter(TextureFilter filter);
+    // converts the loaded normal map so that lookups skip the byte decode, Rgb8 goes back to
+    // decoding the texture; paged normal maps are not converted
+    void set_normal_encoding(NormalEncoding encoding);
+    size_t texture_memory() const;  // bytes held by all texture maps, mip levels included
+    // the maps come from the shared TextureCache, other models may hold the same textures;
+    // they are empty with Virtual storage
+    std::shared_ptr<const Texture> diffuse_map() const;
+    std::shared_ptr<const Texture> normal_map() const;
+    std::shared_ptr<const Texture> specular_map() const;
+    // feedback pass of the demand paged maps: begin_frame prefetches the tiles that the previous
+    // frame recorded, end_frame records the tiles this frame touched; no-ops for resident maps
+    void begin_frame();
+    void end_frame();
+    VirtualTextureStats paging_stats() const;  // summed over the three maps
+    void set_paging_cache(size_t tiles);       // tiles each paged map may keep resident
 };
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include "normal_map.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const double snorm16_max = 32767.;
+
+std::int16_t to_snorm16(double v)
+{
+    return static_cast<std::int16_t>(std::lround(clamp(v, -1., 1.) * snorm16_max));
+}
+
+double sign_not_zero(double v) { return v < 0 ? -1. : 1.; }
+
+}  // namespace
+
+// projects n on the octahedron |x|+|y|+|z| = 1 and folds the lower half over the diagonals
+vec2f octahedral_encode(const vec3f &n)
+{
+    double l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (l1 == 0.) return vec2f(0, 0);
+    vec2f p(n.x / l1, n.y / l1);
+    if (n.z < 0)
+        p = vec2f((1. - std::abs(p.y)) * sign_not_zero(p.x),
+                  (1. - std::abs(p.x)) * sign_not_zero(p.y));
+    return p;
+}
+
+vec3f octahedral_decode(double x, double y)
+{
+    vec3f n(x, y, 1. - std::abs(x) - std::abs(y));
+    double t = std::max(-n.z, 0.);
+    n.x += n.x >= 0 ? -t : t;
+    n.y += n.y >= 0 ? -t : t;
+    return n.normalize();
+}
+
+NormalMap::NormalMap(const Texture &tex, NormalEncoding encoding) : encoding_(encoding)
+{
+    if (encoding == NormalEncoding::Rgb8) encoding_ = NormalEncoding::Float;
+    for (size_t l = 0; l < tex.nlevels(); l++) {
+        Level level;
+        level.width = tex.level_width(l);
+        level.height = tex.level_height(l);
+        size_t texels = level.width * level.height;
+        if (encoding_ == NormalEncoding::Float) level.f.reserve(texels * 3);
+        if (encoding_ == NormalEncoding::Snorm16) level.s.reserve(texels * 3);
+        if (encoding_ == NormalEncoding::Octahedral) level.s.reserve(texels * 2);
+        for (size_t y = 0; y < level.height; y++)
+            for (size_t x = 0; x < level.width; x++) {
+                TGAColor c = tex.fetch(l, x, y);
+                vec3f n;
+                for (size_t i = 0; i < 3; i++) n[2 - i] = c[i] / 255. * 2 - 1;
+                switch (encoding_) {
+                    case NormalEncoding::Rgb8:
+                    case NormalEncoding::Float:
+                        for (size_t i = 0; i < 3; i++)
+                            level.f.push_back(static_cast<float>(n[i]));
+                        break;
+                    case NormalEncoding::Snorm16:
+                        for (size_t i = 0; i < 3; i++) level.s.push_back(to_snorm16(n[i]));
+                        break;
+                    case NormalEncoding::Octahedral: {
+                        vec2f p = octahedral_encode(n);
+                        level.s.push_back(to_snorm16(p.x));
+                        level.s.push_back(to_snorm16(p.y));
+                        break;
+                    }
+                }
+            }
+        levels_.push_back(std::move(level));
+    }
+}
+
+bool NormalMap::empty() const { return levels_.empty(); }
+
+size_t NormalMap::get_width() const { return levels_.empty() ? 0 : levels_[0].width; }
+
+size_t NormalMap::get_height() const { return levels_.empty() ? 0 : levels_[0].height; }
+
+NormalEncoding NormalMap::get_encoding() const { return encoding_; }
+
+size_t NormalMap::memory_bytes() const
+{
+    size_t total = 0;
+    for (auto &level : levels_)
+        total += level.f.size() * sizeof(float) + level.s.size() * sizeof(std::int16_t);
+    return total;
+}
+
+double NormalMap::lod(const vec2f &duvdx, const vec2f &duvdy) const
+{
+    if (levels_.empty()) return 0.;
+    return texture_lod(get_width(), get_height(), duvdx, duvdy);
+}
+
+vec3f NormalMap::fetch(size_t level, size_t x, size_t y) const
+{
+    const Level &l = levels_[level];
+    size_t i = std::min(x, l.width - 1) + std::min(y, l.height - 1) * l.width;
+    switch (encoding_) {
+        case NormalEncoding::Snorm16:
+            return vec3f(l.s[i * 3], l.s[i * 3 + 1], l.s[i * 3 + 2]) * (1. / snorm16_max);
+        case NormalEncoding::Octahedral:
+            return octahedral_decode(l.s[i * 2] / snorm16_max, l.s[i * 2 + 1] / snorm16_max);
+        default: return vec3f(l.f[i * 3], l.f[i * 3 + 1], l.f[i * 3 + 2]);
+    }
+}
+
+vec3f NormalMap::bilinear(size_t level, const vec2f &uv) const
+{
+    const Level &l = levels_[level];
+    double x = clamp(uv.x, 0., 1.) * static_cast<double>(l.width) - .5;
+    double y = clamp(uv.y, 0., 1.) * static_cast<double>(l.height) - .5;
+    double fx = std::floor(x), fy = std::floor(y);
+    double tx = x - fx, ty = y - fy;
+    size_t x0 = static_cast<size_t>(std::max(fx, 0.)), y0 = static_cast<size_t>(std::max(fy, 0.));
+    size_t x1 = fx < 0 ? 0 : x0 + 1, y1 = fy < 0 ? 0 : y0 + 1;
+    vec3f top = fetch(level, x0, y0) * (1 - tx) + fetch(level, x1, y0) * tx;
+    vec3f bottom = fetch(level, x0, y1) * (1 - tx) + fetch(level, x1, y1) * tx;
+    return top * (1 - ty) + bottom * ty;
+}
+
+vec3f NormalMap::sample(const vec2f &uv, double lod, TextureFilter filter) const
+{
+    if (levels_.empty()) return {};
+    lod = clamp(lod, 0., static_cast<double>(levels_.size() - 1));
+    switch (filter) {
+        case TextureFilter::Nearest: {
+            size_t level = static_cast<size_t>(lod + .5);
+            double x = clamp(uv.x, 0., 1.) * static_cast<double>(levels_[level].width);
+            double y = clamp(uv.y, 0., 1.) * static_cast<double>(levels_[level].height);
+            return fetch(level, static_cast<size_t>(x), static_cast<size_t>(y));
+        }
+        case TextureFilter::Bilinear: return bilinear(static_cast<size_t>(lod + .5), uv);
+        case TextureFilter::Trilinear: {
+            size_t lo = static_cast<size_t>(lod);
+            double t = lod - static_cast<double>(lo);
+            vec3f a = bilinear(lo, uv);
+            if (t == 0.) return a;
+            return a * (1 - t) + bilinear(lo + 1, uv) * t;
+        }
+    }
+    return {};
+}
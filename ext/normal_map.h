@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+#include "texture.h"
+
+enum class NormalEncoding
+{
+    Rgb8,       // the map is kept as a texture and decoded on every lookup
+    Snorm16,    // three signed normalized 16 bit components, 6 bytes per texel
+    Float,      // three floats, 12 bytes per texel
+    Octahedral  // unit vector folded onto two signed normalized 16 bit components, 4 bytes
+};
+
+// unit vector to a point of the [-1, 1] square and back
+vec2f octahedral_encode(const vec3f &n);
+vec3f octahedral_decode(double x, double y);
+
+// Normal map decoded once from an 8 bit texture, with the same mip pyramid and filters. Lookups
+// return the stored vectors (or their blend) as they are, without the per texel byte to [-1, 1]
+// conversion; only the octahedral encoding still does some arithmetic, and it always returns
+// vectors of unit length.
+class NormalMap
+{
+private:
+    struct Level
+    {
+        size_t width = 0, height = 0;
+        std::vector<float> f;         // Float
+        std::vector<std::int16_t> s;  // Snorm16 and Octahedral
+    };
+    std::vector<Level> levels_;
+    NormalEncoding encoding_ = NormalEncoding::Float;
+
+    vec3f bilinear(size_t level, const vec2f &uv) const;
+
+public:
+    NormalMap() = default;
+    // tex holds normals in the byte order of the TGA maps; Rgb8 is stored as Float
+    NormalMap(const Texture &tex, NormalEncoding encoding);
+
+    bool empty() const;
+    size_t get_width() const;
+    size_t get_height() const;
+    NormalEncoding get_encoding() const;
+    size_t memory_bytes() const;
+
+    double lod(const vec2f &duvdx, const vec2f &duvdy) const;
+    vec3f fetch(size_t level, size_t x, size_t y) const;
+    vec3f sample(const vec2f &uv, double lod, TextureFilter filter) const;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// number of worker threads to use when the caller passes 0
+inline size_t default_thread_count()
+{
+    size_t n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Process wide pool of default_thread_count() worker threads, started on first use and kept
+// until exit, so that parallel loops and background loads don't create threads per call.
+// Tasks must not block on other queued tasks: parallel_for() never does, its caller runs every
+// band no worker has picked up yet.
+class ThreadPool
+{
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> workers_;
+    bool stopping_ = false;
+
+    explicit ThreadPool(size_t nthreads)
+    {
+        for (size_t i = 0; i < nthreads; i++)
+            workers_.emplace_back([this]() {
+                for (;;) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex_);
+                        ready_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+                        if (tasks_.empty()) return;
+                        task = std::move(tasks_.front());
+                        tasks_.pop_front();
+                    }
+                    task();
+                }
+            });
+    }
+
+public:
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto &t : workers_) t.join();
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    static ThreadPool &instance()
+    {
+        static ThreadPool pool(default_thread_count());
+        return pool;
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    // runs fn on a worker; the future holds its result
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F &&fn)
+    {
+        using R = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+        std::future<R> ret = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.emplace_back([task]() { (*task)(); });
+        }
+        ready_.notify_one();
+        return ret;
+    }
+};
+
+// Splits [begin, end) into contiguous bands and calls fn(band_begin, band_end) for each band,
+// on up to nthreads threads: the calling thread and workers of the ThreadPool. The caller claims
+// bands too and only waits for the ones workers are running, so it's safe to call from a pool
+// task.
+template <typename F>
+void parallel_for(size_t begin, size_t end, F &&fn, size_t nthreads = 0)
+{
+    if (end <= begin) return;
+    size_t count = end - begin;
+    if (!nthreads) nthreads = default_thread_count();
+    nthreads = std::min(nthreads, count);
+    if (nthreads <= 1) {
+        fn(begin, end);
+        return;
+    }
+    size_t band = (count + nthreads - 1) / nthreads;
+    size_t bands = (count + band - 1) / band;
+    // shared with the helpers, which may only start once every band is done
+    struct State
+    {
+        std::atomic<size_t> next{0};
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto state = std::make_shared<State>();
+    auto run = [state, &fn, begin, end, band, bands]() {
+        for (size_t b; (b = state->next++) < bands;) {
+            fn(begin + b * band, std::min(begin + (b + 1) * band, end));
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (++state->done == bands) state->finished.notify_all();
+        }
+    };
+    ThreadPool &pool = ThreadPool::instance();
+    for (size_t i = 1; i < nthreads; i++) pool.submit(run);
+    run();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&]() { return state->done == bands; });
+}
@@ -0,0 +1,207 @@
+#include "resample.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "parallel.h"
+
+namespace {
+
+// every working pixel is padded to 4 float channels so the per tap inner loop is a fixed 4 wide
+// multiply-add the compiler turns into one vector instruction
+const size_t lanes = 4;
+
+double sinc(double x)
+{
+    if (x == 0.) return 1.;
+    x *= 3.14159265358979323846;
+    return std::sin(x) / x;
+}
+
+double kernel_support(ResampleFilter filter)
+{
+    switch (filter) {
+        case ResampleFilter::Box: return .5;
+        case ResampleFilter::Bilinear: return 1.;
+        case ResampleFilter::Lanczos3: return 3.;
+    }
+    return 1.;
+}
+
+double kernel(ResampleFilter filter, double x)
+{
+    switch (filter) {
+        case ResampleFilter::Box: return (x >= -.5 && x < .5) ? 1. : 0.;
+        case ResampleFilter::Bilinear: return std::max(0., 1. - std::abs(x));
+        case ResampleFilter::Lanczos3: return std::abs(x) < 3. ? sinc(x) * sinc(x / 3.) : 0.;
+    }
+    return 0.;
+}
+
+// Filter taps for every output coordinate of one axis: output i reads taps source samples
+// starting at first[i], weighted by weights[i * taps + k].
+struct Contributions
+{
+    size_t taps = 0;
+    std::vector<size_t> first;
+    std::vector<float> weights;
+};
+
+Contributions contributions(size_t in_size, size_t out_size, ResampleFilter filter)
+{
+    double scale = static_cast<double>(in_size) / static_cast<double>(out_size);
+    double filterscale = std::max(scale, 1.);
+    double support = kernel_support(filter) * filterscale;
+
+    std::vector<size_t> xmin(out_size);
+    std::vector<std::vector<double>> w(out_size);
+    size_t taps = 1;
+    for (size_t i = 0; i < out_size; i++) {
+        double center = (static_cast<double>(i) + .5) * scale;
+        size_t lo = static_cast<size_t>(std::max(center - support + .5, 0.));
+        size_t hi =
+            static_cast<size_t>(std::min(center + support + .5, static_cast<double>(in_size)));
+        lo = std::min(lo, in_size - 1);
+        hi = std::max(hi, lo + 1);
+        double total = 0;
+        for (size_t x = lo; x < hi; x++) {
+            w[i].push_back(kernel(filter, (static_cast<double>(x) - center + .5) / filterscale));
+            total += w[i].back();
+        }
+        for (double &v : w[i]) v = total != 0. ? v / total : 1. / static_cast<double>(w[i].size());
+        xmin[i] = lo;
+        taps = std::max(taps, hi - lo);
+    }
+
+    // every output gets the same tap count; windows near the end of the axis are shifted left so
+    // that no tap reads past the last source sample
+    Contributions ret;
+    ret.taps = taps;
+    ret.first.resize(out_size);
+    ret.weights.assign(out_size * taps, 0.f);
+    for (size_t i = 0; i < out_size; i++) {
+        size_t start = std::min(xmin[i], in_size - taps);
+        ret.first[i] = start;
+        for (size_t k = 0; k < w[i].size(); k++)
+            ret.weights[i * taps + xmin[i] - start + k] = static_cast<float>(w[i][k]);
+    }
+    return ret;
+}
+
+std::uint8_t to_byte(float v)
+{
+    return static_cast<std::uint8_t>(std::min(std::max(v + .5f, 0.f), 255.f));
+}
+
+ResampleStats make_stats(std::chrono::steady_clock::time_point start, size_t w, size_t h)
+{
+    ResampleStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double mpix = static_cast<double>(w * h) / 1e6;
+    stats.megapixels_per_sec = stats.seconds > 0 ? mpix / stats.seconds : 0;
+    return stats;
+}
+
+}  // namespace
+
+ResampleStats resample(const TGAImage &src, TGAImage &dst, size_t w, size_t h,
+                       ResampleFilter filter, size_t nthreads)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t sw = src.get_width(), sh = src.get_height(), bpp = src.get_bytespp();
+    if (!w || !h || !sw || !sh) return {};
+    // src may be dst, so the result only replaces it at the end
+    TGAImage out(w, h, bpp);
+
+    Contributions cx = contributions(sw, w, filter);
+    Contributions cy = contributions(sh, h, filter);
+
+    // horizontal pass: every source row to w padded float pixels
+    std::vector<float> tmp(w * sh * lanes);
+    const std::uint8_t *in = src.buffer();
+    parallel_for(
+        0, sh,
+        [&](size_t y0, size_t y1) {
+            std::vector<float> row(sw * lanes, 0.f);
+            for (size_t y = y0; y < y1; y++) {
+                const std::uint8_t *line = in + y * sw * bpp;
+                for (size_t x = 0; x < sw; x++)
+                    for (size_t c = 0; c < bpp; c++) row[x * lanes + c] = line[x * bpp + c];
+                float *out = tmp.data() + y * w * lanes;
+                for (size_t x = 0; x < w; x++) {
+                    float acc[lanes] = {0, 0, 0, 0};
+                    const float *wt = cx.weights.data() + x * cx.taps;
+                    const float *p = row.data() + cx.first[x] * lanes;
+                    for (size_t k = 0; k < cx.taps; k++, p += lanes)
+                        for (size_t c = 0; c < lanes; c++) acc[c] += wt[k] * p[c];
+                    for (size_t c = 0; c < lanes; c++) out[x * lanes + c] = acc[c];
+                }
+            }
+        },
+        nthreads);
+
+    // vertical pass: each output row is a weighted sum of whole scratch rows
+    std::uint8_t *outbuf = out.buffer();
+    size_t row_floats = w * lanes;
+    parallel_for(
+        0, h,
+        [&](size_t y0, size_t y1) {
+            std::vector<float> acc(row_floats);
+            for (size_t y = y0; y < y1; y++) {
+                std::fill(acc.begin(), acc.end(), 0.f);
+                const float *wt = cy.weights.data() + y * cy.taps;
+                for (size_t k = 0; k < cy.taps; k++) {
+                    if (wt[k] == 0.f) continue;
+                    const float *line = tmp.data() + (cy.first[y] + k) * row_floats;
+                    float weight = wt[k];
+                    for (size_t i = 0; i < row_floats; i++) acc[i] += weight * line[i];
+                }
+                std::uint8_t *line = outbuf + y * w * bpp;
+                for (size_t x = 0; x < w; x++)
+                    for (size_t c = 0; c < bpp; c++)
+                        line[x * bpp + c] = to_byte(acc[x * lanes + c]);
+            }
+        },
+        nthreads);
+
+    dst = std::move(out);
+    return make_stats(start, w, h);
+}
+
+ResampleStats downsample_2x(TGAImage &img, size_t nthreads)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t sw = img.width, sh = img.height, bpp = img.bytespp;
+    size_t w = sw / 2, h = sh / 2;
+    if (!w || !h) return {};
+    std::uint8_t *data = img.data.data();
+
+    // average each 2x2 block into the start of its upper source row; every band only touches its
+    // own pair of rows, so the bands can run concurrently
+    parallel_for(
+        0, h,
+        [&](size_t y0, size_t y1) {
+            for (size_t y = y0; y < y1; y++) {
+                std::uint8_t *r0 = data + 2 * y * sw * bpp;
+                const std::uint8_t *r1 = r0 + sw * bpp;
+                for (size_t x = 0; x < w; x++)
+                    for (size_t c = 0; c < bpp; c++) {
+                        unsigned sum = 2u + r0[2 * x * bpp + c] + r0[(2 * x + 1) * bpp + c] +
+                                       r1[2 * x * bpp + c] + r1[(2 * x + 1) * bpp + c];
+                        r0[x * bpp + c] = static_cast<std::uint8_t>(sum >> 2);
+                    }
+            }
+        },
+        nthreads);
+
+    // compact the rows; destinations always precede their sources
+    for (size_t y = 1; y < h; y++)
+        std::memmove(data + y * w * bpp, data + 2 * y * sw * bpp, w * bpp);
+    img.data.resize(w * h * bpp);
+    img.width = static_cast<uint32_t>(w);
+    img.height = static_cast<uint32_t>(h);
+    return make_stats(start, w, h);
+}
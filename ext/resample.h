@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+
+#include "tgaimage.h"
+
+enum class ResampleFilter
+{
+    Box,       // area average when shrinking, nearest when enlarging
+    Bilinear,  // tent filter, widened when shrinking
+    Lanczos3   // windowed sinc with 3 lobes
+};
+
+struct ResampleStats
+{
+    double seconds = 0;
+    double megapixels_per_sec = 0;  // output pixels produced per second
+};
+
+// Separable two pass resampler: a horizontal pass into a float scratch image followed by a
+// vertical pass into dst. Both passes are split into bands of rows across nthreads threads
+// (0 = hardware concurrency) of the ThreadPool. dst is reallocated to w x h with the bytespp of
+// src, and may be src itself.
+ResampleStats resample(const TGAImage &src, TGAImage &dst, size_t w, size_t h,
+                       ResampleFilter filter = ResampleFilter::Bilinear, size_t nthreads = 0);
+
+// Halves both dimensions in place by averaging 2x2 blocks. Odd trailing rows/columns are dropped.
+ResampleStats downsample_2x(TGAImage &img, size_t nthreads = 0);
@@ -0,0 +1,231 @@
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "resample.h"
+
+namespace {
+
+// spreads the low 16 bits of v so that there is a zero bit between each of them
+size_t part1by1(size_t v)
+{
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+size_t ceil_log2(size_t v)
+{
+    size_t bits = 0;
+    while ((size_t(1) << bits) < v) bits++;
+    return bits;
+}
+
+size_t tile_size(TextureLayout layout) { return layout == TextureLayout::Tiled4 ? 4 : 8; }
+
+}  // namespace
+
+Texture::Texture(const TGAImage &img, bool mipmaps, TextureLayout layout, BlockFormat format)
+    : bytespp_(format == BlockFormat::None ? img.get_bytespp() : block_channels(format)),
+      layout_(layout),
+      format_(format)
+{
+    if (!img.get_width() || !img.get_height()) return;
+    TGAImage cur = img;
+    while (true) {
+        store_level(cur);
+        size_t w = cur.get_width(), h = cur.get_height();
+        if (!mipmaps || (w == 1 && h == 1)) break;
+        if (w % 2 == 0 && h % 2 == 0) {
+            downsample_2x(cur);
+        } else {
+            TGAImage next;
+            resample(cur, next, std::max<size_t>(w / 2, 1), std::max<size_t>(h / 2, 1),
+                     ResampleFilter::Box);
+            cur = std::move(next);
+        }
+    }
+}
+
+// The tiled layouts pad each level to whole tiles. The Morton layout interleaves the bits of the
+// shorter padded axis and appends the remaining high bits of the longer one, so that a non
+// square level only pads each axis to a power of two.
+size_t Texture::texel_index(const Level &level, size_t x, size_t y) const
+{
+    switch (layout_) {
+        case TextureLayout::RowMajor: return x + y * level.width;
+        case TextureLayout::Tiled4:
+            return (((y >> 2) * level.tiles_x + (x >> 2)) << 4) + ((y & 3) << 2) + (x & 3);
+        case TextureLayout::Tiled8:
+            return (((y >> 3) * level.tiles_x + (x >> 3)) << 6) + ((y & 7) << 3) + (x & 7);
+        case TextureLayout::Morton: {
+            size_t b = level.morton_bits, mask = (size_t(1) << b) - 1;
+            return (part1by1(x & mask) | (part1by1(y & mask) << 1)) |
+                   (((x >> b) | (y >> b)) << (2 * b));
+        }
+    }
+    return 0;
+}
+
+void Texture::store_level(const TGAImage &img)
+{
+    Level level;
+    level.width = img.get_width();
+    level.height = img.get_height();
+    const std::uint8_t *src = img.buffer();
+    if (format_ != BlockFormat::None) {
+        size_t src_bpp = img.get_bytespp();
+        level.tiles_x = (level.width + 3) / 4;
+        size_t tiles_y = (level.height + 3) / 4;
+        level.data.assign(level.tiles_x * tiles_y * block_bytes(format_), 0);
+        TGAColor block[16];
+        for (size_t by = 0; by < tiles_y; by++)
+            for (size_t bx = 0; bx < level.tiles_x; bx++) {
+                for (size_t i = 0; i < 16; i++) {  // blocks on the border repeat the edge texels
+                    size_t x = std::min(bx * 4 + i % 4, level.width - 1);
+                    size_t y = std::min(by * 4 + i / 4, level.height - 1);
+                    block[i] = TGAColor(src + (x + y * level.width) * src_bpp,
+                                        static_cast<std::uint8_t>(src_bpp));
+                }
+                encode_block(format_, block,
+                             level.data.data() + (bx + by * level.tiles_x) * block_bytes(format_));
+            }
+        levels_.push_back(std::move(level));
+        return;
+    }
+    size_t texels = level.width * level.height;
+    if (layout_ == TextureLayout::Tiled4 || layout_ == TextureLayout::Tiled8) {
+        size_t t = tile_size(layout_);
+        level.tiles_x = (level.width + t - 1) / t;
+        texels = level.tiles_x * ((level.height + t - 1) / t) * t * t;
+    } else if (layout_ == TextureLayout::Morton) {
+        size_t bw = ceil_log2(level.width), bh = ceil_log2(level.height);
+        level.morton_bits = std::min(bw, bh);
+        texels = size_t(1) << (bw + bh);
+    }
+    level.data.assign(texels * bytespp_, 0);
+    for (size_t y = 0; y < level.height; y++)
+        for (size_t x = 0; x < level.width; x++)
+            std::copy(src + (x + y * level.width) * bytespp_,
+                      src + (x + y * level.width + 1) * bytespp_,
+                      level.data.data() + texel_index(level, x, y) * bytespp_);
+    levels_.push_back(std::move(level));
+}
+
+bool Texture::empty() const { return levels_.empty(); }
+
+size_t Texture::get_width() const { return levels_.empty() ? 0 : levels_[0].width; }
+
+size_t Texture::get_height() const { return levels_.empty() ? 0 : levels_[0].height; }
+
+size_t Texture::get_bytespp() const { return bytespp_; }
+
+size_t Texture::nlevels() const { return levels_.size(); }
+
+size_t Texture::level_width(size_t level) const { return levels_[level].width; }
+
+size_t Texture::level_height(size_t level) const { return levels_[level].height; }
+
+size_t Texture::memory_bytes() const
+{
+    size_t total = 0;
+    for (auto &level : levels_) total += level.data.size();
+    return total;
+}
+
+TextureLayout Texture::get_layout() const { return layout_; }
+
+BlockFormat Texture::get_format() const { return format_; }
+
+TextureFilter Texture::get_filter() const { return filter_; }
+
+void Texture::set_filter(TextureFilter filter) { filter_ = filter; }
+
+double texture_lod(size_t width, size_t height, const vec2f &duvdx, const vec2f &duvdy)
+{
+    double w = static_cast<double>(width), h = static_cast<double>(height);
+    double dx = vec2f(duvdx.x * w, duvdx.y * h).norm2();
+    double dy = vec2f(duvdy.x * w, duvdy.y * h).norm2();
+    double rho2 = std::max(dx, dy);
+    if (rho2 <= 1.) return 0.;
+    return .5 * std::log2(rho2);
+}
+
+double Texture::lod(const vec2f &duvdx, const vec2f &duvdy) const
+{
+    if (levels_.empty()) return 0.;
+    return texture_lod(get_width(), get_height(), duvdx, duvdy);
+}
+
+TGAColor Texture::fetch(size_t level, size_t x, size_t y) const
+{
+    const Level &l = levels_[level];
+    x = std::min(x, l.width - 1);
+    y = std::min(y, l.height - 1);
+    if (format_ != BlockFormat::None) {
+        const std::uint8_t *block =
+            l.data.data() + ((x >> 2) + (y >> 2) * l.tiles_x) * block_bytes(format_);
+        return decode_texel(format_, block, (x & 3) + ((y & 3) << 2));
+    }
+    return TGAColor(l.data.data() + texel_index(l, x, y) * bytespp_,
+                    static_cast<uint8_t>(bytespp_));
+}
+
+TGAColor Texture::bilinear(size_t level, const vec2f &uv) const
+{
+    const Level &l = levels_[level];
+    double x = clamp(uv.x, 0., 1.) * static_cast<double>(l.width) - .5;
+    double y = clamp(uv.y, 0., 1.) * static_cast<double>(l.height) - .5;
+    double fx = std::floor(x), fy = std::floor(y);
+    double tx = x - fx, ty = y - fy;
+    size_t x0 = static_cast<size_t>(std::max(fx, 0.)), y0 = static_cast<size_t>(std::max(fy, 0.));
+    size_t x1 = fx < 0 ? 0 : x0 + 1, y1 = fy < 0 ? 0 : y0 + 1;
+    TGAColor c00 = fetch(level, x0, y0), c10 = fetch(level, x1, y0);
+    TGAColor c01 = fetch(level, x0, y1), c11 = fetch(level, x1, y1);
+    TGAColor res = c00;
+    for (size_t i = 0; i < bytespp_; i++) {
+        double top = c00[i] + (c10[i] - c00[i]) * tx;
+        double bottom = c01[i] + (c11[i] - c01[i]) * tx;
+        res[i] = static_cast<uint8_t>(top + (bottom - top) * ty + .5);
+    }
+    return res;
+}
+
+TGAColor Texture::sample(const vec2f &uv, double lod) const { return sample(uv, lod, filter_); }
+
+TGAColor Texture::sample(const vec2f &uv, double lod, TextureFilter filter) const
+{
+    if (levels_.empty()) return {};
+    double max_lod = static_cast<double>(levels_.size() - 1);
+    lod = clamp(lod, 0., max_lod);
+    switch (filter) {
+        case TextureFilter::Nearest: {
+            const Level &l = levels_[static_cast<size_t>(lod + .5)];
+            double x = clamp(uv.x, 0., 1.) * static_cast<double>(l.width);
+            double y = clamp(uv.y, 0., 1.) * static_cast<double>(l.height);
+            return fetch(static_cast<size_t>(lod + .5), static_cast<size_t>(x),
+                         static_cast<size_t>(y));
+        }
+        case TextureFilter::Bilinear: return bilinear(static_cast<size_t>(lod + .5), uv);
+        case TextureFilter::Trilinear: {
+            size_t lo = static_cast<size_t>(lod);
+            double t = lod - static_cast<double>(lo);
+            TGAColor a = bilinear(lo, uv);
+            if (t == 0.) return a;
+            TGAColor b = bilinear(lo + 1, uv);
+            for (size_t i = 0; i < bytespp_; i++)
+                a[i] = static_cast<uint8_t>(a[i] + (b[i] - a[i]) * t + .5);
+            return a;
+        }
+    }
+    return {};
+}
+
+TGAColor Texture::sample(const vec2f &uv, const vec2f &duvdx, const vec2f &duvdy) const
+{
+    return sample(uv, lod(duvdx, duvdy));
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+#include "tgaimage.h"
+#include "block_compression.h"
+
+enum class TextureFilter
+{
+    Nearest,   // nearest texel of the nearest mip level
+    Bilinear,  // 2x2 texel blend within the nearest mip level
+    Trilinear  // bilinear blend of the two mip levels around the lod
+};
+
+enum class TextureLayout
+{
+    RowMajor,  // same order as TGAImage
+    Tiled4,    // 4x4 texel tiles, tiles in row major order
+    Tiled8,    // 8x8 texel tiles, tiles in row major order
+    Morton     // Z-order curve, keeps 2D neighbourhoods close in memory in every direction
+};
+
+// level of detail of a width x height texture from the screen space derivatives of the uvs
+double texture_lod(size_t width, size_t height, const vec2f &duvdx, const vec2f &duvdy);
+
+// Read only texture with a precomputed mip pyramid. Texture coordinates are in [0, 1] and are
+// clamped to the edge texels. A block compressed texture keeps its 4x4 blocks in row major order,
+// whatever the layout, and decodes the texels it fetches on the fly.
+class Texture
+{
+private:
+    struct Level
+    {
+        size_t width = 0, height = 0;
+        size_t tiles_x = 0;              // tiles per row for the tiled and compressed layouts
+        size_t morton_bits = 0;          // bits interleaved from x and y for the Morton layout
+        std::vector<std::uint8_t> data;  // bytespp bytes per texel, ordered by layout_
+    };
+    std::vector<Level> levels_;
+    size_t bytespp_ = 0;
+    TextureFilter filter_ = TextureFilter::Nearest;
+    TextureLayout layout_ = TextureLayout::RowMajor;
+    BlockFormat format_ = BlockFormat::None;
+
+    size_t texel_index(const Level &level, size_t x, size_t y) const;
+    void store_level(const TGAImage &img);
+
+    TGAColor bilinear(size_t level, const vec2f &uv) const;
+
+public:
+    Texture() = default;
+    explicit Texture(const TGAImage &img, bool mipmaps = true,
+                     TextureLayout layout = TextureLayout::RowMajor,
+                     BlockFormat format = BlockFormat::None);
+
+    bool empty() const;
+    size_t get_width() const;
+    size_t get_height() const;
+    size_t get_bytespp() const;
+    size_t nlevels() const;
+    size_t level_width(size_t level) const;
+    size_t level_height(size_t level) const;
+    size_t memory_bytes() const;
+    TextureLayout get_layout() const;
+    BlockFormat get_format() const;
+
+    TextureFilter get_filter() const;
+    void set_filter(TextureFilter filter);
+
+    // level of detail from the screen space derivatives of the texture coordinates
+    double lod(const vec2f &duvdx, const vec2f &duvdy) const;
+
+    TGAColor fetch(size_t level, size_t x, size_t y) const;
+    TGAColor sample(const vec2f &uv, double lod, TextureFilter filter) const;
+    TGAColor sample(const vec2f &uv, double lod = 0.) const;
+    TGAColor sample(const vec2f &uv, const vec2f &duvdx, const vec2f &duvdy) const;
+};
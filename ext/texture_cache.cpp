@@ -0,0 +1,97 @@
+#include "texture_cache.h"
+
+#include <filesystem>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+const size_t default_budget = size_t(512) << 20;
+
+TextureCache::TextureCache() { stats_.budget_bytes = default_budget; }
+
+TextureCache &TextureCache::instance()
+{
+    static TextureCache cache;
+    return cache;
+}
+
+std::shared_ptr<const Texture> TextureCache::load(const std::string &filename,
+                                                  TextureLayout layout, BlockFormat format)
+{
+    std::error_code ec;
+    fs::path path = fs::canonical(filename, ec);
+    if (ec) {
+        std::cerr << "can't open file " << filename << "\n";
+        return nullptr;
+    }
+    auto mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+    std::string key = path.string() + "|" + std::to_string(mtime) + "|" +
+                      std::to_string(static_cast<int>(layout)) + "|" +
+                      std::to_string(static_cast<int>(format));
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            stats_.hits++;
+            it->second.last_use = ++clock_;
+            return it->second.texture;
+        }
+        stats_.misses++;
+    }
+
+    // decode without holding the lock, so that different files load concurrently
+    TGAImage img;
+    if (!img.read_tga_file(path.string())) return nullptr;
+    img.flip_vertically();
+    auto texture = std::make_shared<const Texture>(img, true, layout, format);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &entry = entries_[key];
+    if (!entry.texture) {  // another thread may have loaded the same file meanwhile
+        entry.texture = texture;
+        entry.bytes = texture->memory_bytes();
+        stats_.resident_bytes += entry.bytes;
+    }
+    entry.last_use = ++clock_;
+    texture = entry.texture;
+    evict_locked();
+    return texture;
+}
+
+void TextureCache::evict_locked()
+{
+    while (stats_.resident_bytes > stats_.budget_bytes) {
+        auto victim = entries_.end();
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->second.texture.use_count() > 1) continue;  // still held by a model
+            if (victim == entries_.end() || it->second.last_use < victim->second.last_use)
+                victim = it;
+        }
+        if (victim == entries_.end()) return;
+        stats_.resident_bytes -= victim->second.bytes;
+        stats_.evictions++;
+        entries_.erase(victim);
+    }
+}
+
+void TextureCache::set_budget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.budget_bytes = bytes;
+    evict_locked();
+}
+
+TextureCacheStats TextureCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    TextureCacheStats ret = stats_;
+    ret.entries = entries_.size();
+    return ret;
+}
+
+void TextureCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    stats_.resident_bytes = 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "texture.h"
+
+struct TextureCacheStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t resident_bytes = 0;  // texture memory referenced by the cache
+    size_t budget_bytes = 0;
+};
+
+// Process wide registry of loaded textures. A texture is identified by the canonical path and
+// modification time of its file together with the layout and block format it was converted to,
+// so the same asset is decoded once and shared by every Model that uses it. Handles are shared
+// and immutable, so a texture stays alive for as long as any model holds it. Once the resident
+// size goes over the budget, the least recently used textures that no model references any
+// more are dropped.
+class TextureCache
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<const Texture> texture;
+        size_t bytes = 0;
+        std::uint64_t last_use = 0;
+    };
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    std::uint64_t clock_ = 0;
+    TextureCacheStats stats_;
+
+    TextureCache();
+    void evict_locked();
+
+public:
+    static TextureCache &instance();
+
+    // reads, vertically flips and converts filename; returns nullptr if it can't be loaded
+    std::shared_ptr<const Texture> load(const std::string &filename,
+                                        TextureLayout layout = TextureLayout::RowMajor,
+                                        BlockFormat format = BlockFormat::None);
+    void set_budget(size_t bytes);
+    TextureCacheStats stats() const;
+    void clear();
+};
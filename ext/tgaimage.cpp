@@ -1,7 +1,9 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <algorithm>
 #include "tgaimage.h"
+#include "resample.h"
 
 TGAImage::TGAImage() {}
 TGAImage::TGAImage(const size_t w, const size_t h, const size_t bpp)
@@ -221,7 +223,7 @@ void TGAImage::set(size_t x, size_t y, const TGAColor &c)
     memcpy(data.data() + (x + y * width) * bytespp, c.bgra, bytespp);
 }
 
-size_t TGAImage::get_bytespp() { return bytespp; }
+size_t TGAImage::get_bytespp() const { return bytespp; }
 
 size_t TGAImage::get_width() const { return width; }
 
@@ -258,41 +260,14 @@ void TGAImage::flip_vertically()
 
 std::uint8_t *TGAImage::buffer() { return data.data(); }
 
-void TGAImage::clear() { data = std::vector<std::uint8_t>(width * height * bytespp, 0); }
+const std::uint8_t *TGAImage::buffer() const { return data.data(); }
+
+void TGAImage::clear() { std::fill(data.begin(), data.end(), 0); }
 
 void TGAImage::scale(size_t w, size_t h)
 {
     if (w <= 0 || h <= 0 || !data.size()) return;
-    std::vector<std::uint8_t> tdata(w * h * bytespp, 0);
-    int n_scanline = 0;
-    int oscanline = 0;
-    int err_y = 0;
-    int n_line_bytes = w * bytespp;
-    int olinebytes = width * bytespp;
-    for (uint32_t j = 0; j < height; j++) {
-        int errx = width - w;
-        int nx = -static_cast<int>(bytespp);
-        int ox = -static_cast<int>(bytespp);
-        for (uint32_t i = 0; i < width; i++) {
-            ox += bytespp;
-            errx += w;
-            while (errx >= (int)width) {
-                errx -= width;
-                nx += bytespp;
-                memcpy(tdata.data() + n_scanline + nx, data.data() + oscanline + ox, bytespp);
-            }
-        }
-        err_y += h;
-        oscanline += olinebytes;
-        while (err_y >= (int)height) {
-            if (err_y >= (int)height << 1)  // it means we jump over a scanline
-                memcpy(tdata.data() + n_scanline + n_line_bytes, tdata.data() + n_scanline,
-                       n_line_bytes);
-            err_y -= height;
-            n_scanline += n_line_bytes;
-        }
-    }
-    data = tdata;
-    width = (uint32_t)w;
-    height = (uint32_t)h;
+    TGAImage scaled;
+    resample(*this, scaled, w, h, ResampleFilter::Box);
+    *this = std::move(scaled);
 }
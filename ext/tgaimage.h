@@ -21,6 +21,8 @@ struct TGA_Header
     std::uint8_t imagedescriptor{};
 };
 #pragma pack(pop)
+struct ResampleStats;
+
 struct TGAColor
 {
     std::uint8_t bgra[4] = {0, 0, 0, 0};
@@ -60,6 +62,8 @@ protected:
     bool load_rle_data(std::ifstream &in);
     bool unload_rle_data(std::ofstream &out) const;
 
+    friend ResampleStats downsample_2x(TGAImage &img, size_t nthreads);
+
 public:
     enum Format
     {
@@ -80,7 +84,8 @@ public:
     void set(const size_t x, const size_t y, const TGAColor &c);
     size_t get_width() const;
     size_t get_height() const;
-    size_t get_bytespp();
+    size_t get_bytespp() const;
     std::uint8_t *buffer();
+    const std::uint8_t *buffer() const;
     void clear();
 };
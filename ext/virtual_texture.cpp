@@ -0,0 +1,269 @@
+#include "virtual_texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+VirtualTexture::VirtualTexture(const std::string &filename, size_t tile_size, size_t cache_tiles)
+    : tile_size_(tile_size), capacity_(std::max<size_t>(cache_tiles, 1))
+{
+    if (!tile_size_ || !build_index(filename)) {
+        width_ = height_ = 0;
+        return;
+    }
+    tiles_x_ = (width_ + tile_size_ - 1) / tile_size_;
+    tiles_y_ = (height_ + tile_size_ - 1) / tile_size_;
+    size_t ntiles = tiles_x_ * tiles_y_;
+    pages_.resize(ntiles);
+    last_use_ = std::vector<std::atomic<std::uint64_t>>(ntiles);
+    touched_ = std::vector<std::atomic<std::uint8_t>>(ntiles);
+    stats_.total_tiles = ntiles;
+}
+
+// Reads the header and records where every texture row starts in the file. Raw packets are
+// skipped with a seek, so building the index doesn't decode the image.
+bool VirtualTexture::build_index(const std::string &filename)
+{
+    in_.open(filename, std::ios::binary);
+    if (!in_.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    TGA_Header header{};
+    in_.read(reinterpret_cast<char *>(&header), sizeof(header));
+    in_.seekg(header.idlength, std::ios::cur);
+    width_ = header.width;
+    height_ = header.height;
+    bytespp_ = header.bitsperpixel >> 3;
+    if (!in_.good() || !width_ || !height_ ||
+        (bytespp_ != TGAImage::GRAYSCALE && bytespp_ != TGAImage::RGB &&
+         bytespp_ != TGAImage::RGBA)) {
+        std::cerr << "bad bpp (or width/height) value\n";
+        return false;
+    }
+    rle_ = header.datatypecode == 10 || header.datatypecode == 11;
+    if (!rle_ && header.datatypecode != 2 && header.datatypecode != 3) {
+        std::cerr << "unknown file format " << (size_t)header.datatypecode << "\n";
+        return false;
+    }
+    // Model flips its maps after TGAImage brought them to top-left origin, which puts the first
+    // row of a bottom-left origin file at texture row 0
+    bool top_down = header.imagedescriptor & 0x20;
+    flip_x_ = header.imagedescriptor & 0x10;
+    auto texture_row = [&](size_t r) { return top_down ? height_ - 1 - r : r; };
+
+    rows_.resize(height_);
+    std::streamoff data_start = in_.tellg();
+    if (!rle_) {
+        for (size_t r = 0; r < height_; r++)
+            rows_[texture_row(r)].offset =
+                data_start + static_cast<std::streamoff>(r * width_ * bytespp_);
+        return true;
+    }
+    size_t pixel = 0, row = 0, npixels = width_ * height_;
+    while (pixel < npixels) {
+        std::streamoff offset = in_.tellg();
+        int chunkheader = in_.get();
+        if (!in_.good()) {
+            std::cerr << "an error occurred while reading the data\n";
+            return false;
+        }
+        size_t count = static_cast<size_t>(chunkheader & 127) + 1;
+        for (; row < height_ && row * width_ < pixel + count; row++)
+            rows_[texture_row(row)] = {offset, row * width_ - pixel};
+        size_t payload = chunkheader & 128 ? bytespp_ : count * bytespp_;
+        in_.seekg(static_cast<std::streamoff>(payload), std::ios::cur);
+        pixel += count;
+    }
+    return true;
+}
+
+void VirtualTexture::decode_row(size_t y, std::vector<std::uint8_t> &row) const
+{
+    row.resize(width_ * bytespp_);
+    in_.clear();
+    in_.seekg(rows_[y].offset);
+    if (!rle_) {
+        in_.read(reinterpret_cast<char *>(row.data()), static_cast<std::streamsize>(row.size()));
+    } else {
+        size_t skip = rows_[y].skip, done = 0;
+        while (done < width_ && in_.good()) {
+            int chunkheader = in_.get();
+            size_t count = static_cast<size_t>(chunkheader & 127) + 1;
+            size_t n = std::min(count - skip, width_ - done);
+            std::uint8_t *dst = row.data() + done * bytespp_;
+            if (chunkheader & 128) {
+                std::uint8_t color[4];
+                in_.read(reinterpret_cast<char *>(color), static_cast<std::streamsize>(bytespp_));
+                for (size_t i = 0; i < n; i++)
+                    std::copy(color, color + bytespp_, dst + i * bytespp_);
+            } else {
+                in_.seekg(static_cast<std::streamoff>(skip * bytespp_), std::ios::cur);
+                in_.read(reinterpret_cast<char *>(dst), static_cast<std::streamsize>(n * bytespp_));
+            }
+            done += n;
+            skip = 0;
+        }
+    }
+    if (flip_x_)
+        for (size_t i = 0; i < width_ / 2; i++) {
+            std::uint8_t *a = row.data() + i * bytespp_;
+            std::swap_ranges(a, a + bytespp_, row.data() + (width_ - 1 - i) * bytespp_);
+        }
+}
+
+// Drops the count least recently used resident tiles. Readers still holding one of their pages
+// keep it until they are done.
+void VirtualTexture::evict(size_t count) const
+{
+    count = std::min(count, resident_.size());
+    if (!count) return;
+    auto older = [&](size_t a, size_t b) {
+        return last_use_[a].load(std::memory_order_relaxed) <
+               last_use_[b].load(std::memory_order_relaxed);
+    };
+    auto nth = resident_.begin() + static_cast<std::ptrdiff_t>(count);
+    std::nth_element(resident_.begin(), nth - 1, resident_.end(), older);
+    for (auto it = resident_.begin(); it != nth; ++it)
+        std::atomic_store(&pages_[*it], std::shared_ptr<const Page>());
+    resident_.erase(resident_.begin(), nth);
+    stats_.evictions += count;
+}
+
+// Decodes a batch of tiles that aren't resident; tiles in the same band of rows share every
+// decoded scanline. Called with mutex_ held.
+void VirtualTexture::load_tiles(std::vector<size_t> tiles) const
+{
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+    if (tiles.size() > capacity_) tiles.resize(capacity_);
+    if (resident_.size() + tiles.size() > capacity_)
+        evict(resident_.size() + tiles.size() - capacity_);
+    std::uint64_t now = ++clock_;
+    std::vector<std::uint8_t> row;
+    for (size_t first = 0; first < tiles.size();) {
+        size_t ty = tiles[first] / tiles_x_, last = first;
+        while (last < tiles.size() && tiles[last] / tiles_x_ == ty) last++;
+        std::vector<std::shared_ptr<Page>> band;
+        for (size_t i = first; i < last; i++)
+            band.push_back(std::make_shared<Page>(tile_size_ * tile_size_ * bytespp_));
+        size_t y0 = ty * tile_size_, y1 = std::min(y0 + tile_size_, height_);
+        for (size_t y = y0; y < y1; y++) {
+            decode_row(y, row);
+            for (size_t i = first; i < last; i++) {
+                size_t x0 = (tiles[i] % tiles_x_) * tile_size_;
+                size_t x1 = std::min(x0 + tile_size_, width_);
+                std::copy(row.begin() + static_cast<std::ptrdiff_t>(x0 * bytespp_),
+                          row.begin() + static_cast<std::ptrdiff_t>(x1 * bytespp_),
+                          band[i - first]->begin() +
+                              static_cast<std::ptrdiff_t>((y - y0) * tile_size_ * bytespp_));
+            }
+        }
+        // published once decoded
+        for (size_t i = first; i < last; i++) {
+            last_use_[tiles[i]].store(now, std::memory_order_relaxed);
+            std::atomic_store(&pages_[tiles[i]], std::shared_ptr<const Page>(band[i - first]));
+            resident_.push_back(tiles[i]);
+        }
+        first = last;
+    }
+}
+
+std::shared_ptr<const VirtualTexture::Page> VirtualTexture::page(size_t tile) const
+{
+    if (!touched_[tile].load(std::memory_order_relaxed))
+        touched_[tile].store(1, std::memory_order_relaxed);
+    last_use_[tile].store(clock_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    std::shared_ptr<const Page> ret = std::atomic_load(&pages_[tile]);
+    if (ret) return ret;
+    std::lock_guard<std::mutex> lock(mutex_);
+    ret = std::atomic_load(&pages_[tile]);  // another thread may have loaded it meanwhile
+    if (ret) return ret;
+    stats_.page_faults++;
+    load_tiles({tile});
+    return std::atomic_load(&pages_[tile]);
+}
+
+TGAColor VirtualTexture::texel(size_t x, size_t y) const
+{
+    x = std::min(x, width_ - 1);
+    y = std::min(y, height_ - 1);
+    std::shared_ptr<const Page> p = page((y / tile_size_) * tiles_x_ + x / tile_size_);
+    return TGAColor(p->data() + ((y % tile_size_) * tile_size_ + x % tile_size_) * bytespp_,
+                    static_cast<std::uint8_t>(bytespp_));
+}
+
+bool VirtualTexture::empty() const { return !width_; }
+
+size_t VirtualTexture::get_width() const { return width_; }
+
+size_t VirtualTexture::get_height() const { return height_; }
+
+size_t VirtualTexture::memory_bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resident_.size() * tile_size_ * tile_size_ * bytespp_;
+}
+
+void VirtualTexture::set_cache_tiles(size_t tiles)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = std::max<size_t>(tiles, 1);
+    if (resident_.size() > capacity_) evict(resident_.size() - capacity_);
+}
+
+TGAColor VirtualTexture::fetch(size_t x, size_t y) const
+{
+    if (empty()) return {};
+    return texel(x, y);
+}
+
+TGAColor VirtualTexture::sample(const vec2f &uv, bool bilinear) const
+{
+    if (empty()) return {};
+    double x = clamp(uv.x, 0., 1.) * static_cast<double>(width_);
+    double y = clamp(uv.y, 0., 1.) * static_cast<double>(height_);
+    if (!bilinear) return texel(static_cast<size_t>(x), static_cast<size_t>(y));
+    x -= .5;
+    y -= .5;
+    double fx = std::floor(x), fy = std::floor(y);
+    double tx = x - fx, ty = y - fy;
+    size_t x0 = static_cast<size_t>(std::max(fx, 0.)), y0 = static_cast<size_t>(std::max(fy, 0.));
+    size_t x1 = fx < 0 ? 0 : x0 + 1, y1 = fy < 0 ? 0 : y0 + 1;
+    TGAColor c00 = texel(x0, y0), c10 = texel(x1, y0);
+    TGAColor c01 = texel(x0, y1), c11 = texel(x1, y1);
+    TGAColor res = c00;
+    for (size_t i = 0; i < bytespp_; i++) {
+        double top = c00[i] + (c10[i] - c00[i]) * tx;
+        double bottom = c01[i] + (c11[i] - c01[i]) * tx;
+        res[i] = static_cast<std::uint8_t>(top + (bottom - top) * ty + .5);
+    }
+    return res;
+}
+
+void VirtualTexture::begin_frame()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<size_t> missing;
+    for (size_t tile : feedback_)
+        if (!std::atomic_load(&pages_[tile])) missing.push_back(tile);
+    stats_.prefetched += std::min(missing.size(), capacity_);
+    load_tiles(missing);
+}
+
+std::vector<size_t> VirtualTexture::end_frame()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    feedback_.clear();
+    for (size_t tile = 0; tile < touched_.size(); tile++)
+        if (touched_[tile].exchange(0, std::memory_order_relaxed)) feedback_.push_back(tile);
+    return feedback_;
+}
+
+VirtualTextureStats VirtualTexture::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    VirtualTextureStats ret = stats_;
+    ret.resident_tiles = resident_.size();
+    return ret;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+#include "tgaimage.h"
+
+struct VirtualTextureStats
+{
+    size_t page_faults = 0;  // tiles decoded because a lookup touched a tile that wasn't resident
+    size_t prefetched = 0;   // tiles decoded ahead of time from the previous frame's feedback
+    size_t evictions = 0;
+    size_t resident_tiles = 0;
+    size_t total_tiles = 0;
+};
+
+// Demand paged texture. Only a scanline index of the TGA file is built up front; square tiles of
+// texels are decoded from the file the first time a lookup touches them and are kept in a fixed
+// size cache with least recently used eviction. Every tile touched since the last end_frame() is
+// recorded, and begin_frame() decodes that set ahead of the next frame's lookups. The texture has
+// the same orientation as the maps Model loads (vertically flipped), and only the finest level:
+// lookups are nearest or bilinear at full resolution.
+// Lookups are safe from several threads, and those that hit a resident tile don't take the
+// texture's mutex, only the atomic load of the tile's page: a page is shared with the readers
+// that hold it, so evicting its tile never changes it under a reader. Recency is a per tile stamp
+// of a clock that advances with every load, so eviction is least recently used to the
+// granularity of a load.
+class VirtualTexture
+{
+private:
+    struct RowStart
+    {
+        std::streamoff offset = 0;  // file offset of the packet (rle) or of the row (raw)
+        size_t skip = 0;            // pixels of that packet that belong to previous rows
+    };
+    using Page = std::vector<std::uint8_t>;
+
+    mutable std::mutex mutex_;  // held by loads, evictions and the statistics
+    mutable std::ifstream in_;
+    std::vector<RowStart> rows_;  // indexed by texture row
+    size_t width_ = 0, height_ = 0, bytespp_ = 0;
+    bool rle_ = false, flip_x_ = false;
+
+    size_t tile_size_ = 0, tiles_x_ = 0, tiles_y_ = 0, capacity_ = 0;
+    // by tile, null when not resident; only accessed through std::atomic_load/atomic_store
+    mutable std::vector<std::shared_ptr<const Page>> pages_;
+    mutable std::vector<size_t> resident_;  // tiles with a page
+    mutable std::vector<std::atomic<std::uint64_t>> last_use_;  // clock at the last lookup
+    mutable std::atomic<std::uint64_t> clock_{0};
+    mutable std::vector<std::atomic<std::uint8_t>> touched_;  // feedback for the current frame
+    std::vector<size_t> feedback_;                            // tiles the previous frame needed
+    mutable VirtualTextureStats stats_;
+
+    bool build_index(const std::string &filename);
+    void decode_row(size_t y, std::vector<std::uint8_t> &row) const;
+    void evict(size_t count) const;
+    void load_tiles(std::vector<size_t> tiles) const;
+    std::shared_ptr<const Page> page(size_t tile) const;
+    TGAColor texel(size_t x, size_t y) const;
+
+public:
+    VirtualTexture(const std::string &filename, size_t tile_size = 128, size_t cache_tiles = 64);
+
+    bool empty() const;
+    size_t get_width() const;
+    size_t get_height() const;
+    size_t memory_bytes() const;  // bytes held by resident tiles
+    // resizes the cache, evicting the least recently used tiles that no longer fit
+    void set_cache_tiles(size_t tiles);
+
+    TGAColor fetch(size_t x, size_t y) const;
+    TGAColor sample(const vec2f &uv, bool bilinear) const;
+
+    // decodes the tiles recorded during the previous frame before they are looked up
+    void begin_frame();
+    // ends the feedback pass: returns the tiles this frame touched and keeps them for prefetch
+    std::vector<size_t> end_frame();
+    VirtualTextureStats stats() const;
+};
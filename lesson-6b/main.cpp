@@ -17,7 +17,8 @@ struct PhongShader : public IShader
                             // fragment shader
     mat<4, 3> varying_tri;  // triangle coordinates (clip coordinates), written by VS, read by FS
     mat<3, 3> varying_nrm;  // normal per vertex to be interpolated by FS
-    mat<3, 3> ndc_tri;      // triangle in normalized device coordinates
+    mat<3, 3> varying_tan;  // tangent per vertex
+    mat<3, 3> varying_bit;  // bitangent per vertex
 
     vec3f uniform_light_dir;
 
@@ -25,13 +26,16 @@ struct PhongShader : public IShader
     {
         vec4f gl_Vertex =
             uniform_Projection * uniform_ModelView * embed<4>(model.vert(iface, nthvert));
-        ndc_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
 
         varying_tri.set_col(nthvert, gl_Vertex);
         varying_uv.set_col(nthvert, model.uv(iface, nthvert));
         varying_nrm.set_col(nthvert,
                             proj<3>((uniform_Projection * uniform_ModelView).invert_transpose() *
                                     embed<4>(model.normal(iface, nthvert), 0.)));
+        varying_tan.set_col(nthvert, proj<3>(uniform_Projection * uniform_ModelView *
+                                             embed<4>(model.tangent(iface, nthvert), 0.)));
+        varying_bit.set_col(nthvert, proj<3>(uniform_Projection * uniform_ModelView *
+                                             embed<4>(model.bitangent(iface, nthvert), 0.)));
         return uniform_Viewport * gl_Vertex;
     }
 
@@ -40,21 +44,9 @@ struct PhongShader : public IShader
         vec3f bn = (varying_nrm * bar).normalize();
         vec2f uv = varying_uv * bar;
 
-        mat<3, 3> A;
-        A[0] = ndc_tri.col(1) - ndc_tri.col(0);
-        A[1] = ndc_tri.col(2) - ndc_tri.col(0);
-        A[2] = bn;
-
-        mat<3, 3> AI = A.invert();
-
-        vec3f i =
-            AI * vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
-        vec3f j =
-            AI * vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
-
-        mat<3, 3> B;
-        B.set_col(0, i.normalize());
-        B.set_col(1, j.normalize());
+        mat<3, 3> B;  // tangent space to screen space, the frame was precomputed per vertex
+        B.set_col(0, (varying_tan * bar).normalize());
+        B.set_col(1, (varying_bit * bar).normalize());
         B.set_col(2, bn);
 
         vec3f n = (B * model.normal(uv)).normalize();
@@ -68,7 +60,8 @@ struct PhongShader : public IShader
 
 int main()
 {
-    Model model{"obj/african_head.obj", true, false, false};
+    Model model{"obj/african_head.obj", true, true, false};
+    model.set_normal_encoding(NormalEncoding::Float);
 
     light_dir.normalize();
 
@@ -3,143 +3,293 @@
 #include "tgaimage.h"
 #include "model.h"
 
+#include "relight.h"
+#include "shaders.h"
+
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+
+#include "resample.h"
+
 const int width = 1000;
 const int height = 1000;
+const size_t shadow_size = 1024;  // independent of the frame, the light frustum is fitted
+const bool shadow_debug_image = false;  // also write the shadow buffer to depth.tga
+const char *shadow_cache_dir = "";      // keep shadow maps there across runs, if not empty
+enum class ShadingPath
+{
+    Forward,
+    Deferred,   // shade from a G-buffer, once per pixel
+    Visibility,  // shade from per pixel face ids, once per pixel
+    Progressive  // the same, coarse to fine, writing progressive_<pass>.tga after every pass
+};
+const ShadingPath shading_path = ShadingPath::Forward;
+const size_t progressive_step = 4;  // pixel spacing of the first progressive pass
+// if not 0, the deferred path rasterizes once and relights for that many light directions
+// around the model, writing relight_<step>.tga for each
+const size_t relight_steps = 0;
+// if not 0, the visibility path renders an orbit of the camera around the model in that many
+// frames, reusing the shading of every frame in the next one; the last frame is written
+const size_t orbit_frames = 0;
+const double orbit_step = 1;           // degrees per frame
+const bool orbit_error_check = false;  // also shade the reused pixels, to report the error
+const size_t local_light_count = 0;  // point and spot lights around the model, Forward+ shaded
+const size_t msaa_samples = 1;       // 2, 4 or 8 to anti-alias the forward path, no local lights
+// the forward path shades 2x2 or 4x4 pixel blocks at once, everywhere or where adapted
+const ShadingRate shading_rate = ShadingRate::Full;
+const bool adaptive_shading_rate = false;  // per 8x8 tile, from the depth of a pre-pass
+// if not 0, the forward path renders budget_frames frames at a dynamic resolution that brings
+// their time down to this, each upscaled to the output; the last one is written
+const double frame_budget_ms = 0;
+const size_t budget_frames = 8;
 
 vec3f light_dir(1, 1, 1);
 vec3f eye(1, 1, 3);
 vec3f center(0, 0, 0);
 vec3f up(0, 1, 0);
 
-struct DepthShader : public IShader
+// dim point and spot lights on a shell around the model, the spots aimed at its center
+std::vector<Light> scatter_lights(size_t n)
 {
-    mat<3, 3> varying_tri;
-
-    virtual vec4f vertex(Model& model, int iface, int nthvert)
-    {
-        vec4f gl_Vertex = embed<4>(model.vert(iface, nthvert));  // read the vertex from .obj file
-        gl_Vertex = uniform_Viewport * uniform_Projection * uniform_ModelView *
-                    gl_Vertex;  // transform it to screen coordinates
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        return gl_Vertex;
-    }
-
-    virtual bool fragment(Model& model, vec3f bar, TGAColor& color)
-    {
-        vec3f p = varying_tri * bar;
-        color = TGAColor(255, 255, 255) * (p.z / 500.f);
-        return false;
-    }
-};
-struct Shader : public IShader
-{
-    mat<4, 4> uniform_M;        //  Projection*ModelView
-    mat<4, 4> uniform_MIT;      // (Projection*ModelView).invert_transpose()
-    mat<4, 4> uniform_Mshadow;  // transform framebuffer screen coordinates to shadowbuffer screen
-                                // coordinates
-    mat<2, 3> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the
-                           // fragment shader
-    mat<3, 3>
-        varying_tri;  // triangle coordinates before Viewport transform, written by VS, read by FS
-    DepthBuffer& shadow_buffer;  // shadow_buffer
-
-    Shader(mat4 M, mat4 MIT, mat4 MS, DepthBuffer& shadow_buffer)
-        : uniform_M(M),
-          uniform_MIT(MIT),
-          uniform_Mshadow(MS),
-          varying_uv(),
-          shadow_buffer(shadow_buffer),
-          varying_tri()
-    {}
-
-    virtual vec4f vertex(Model& model, int iface, int nthvert)
-    {
-        varying_uv.set_col(nthvert, model.uv(iface, nthvert));
-        vec4f gl_Vertex = uniform_Viewport * uniform_Projection * uniform_ModelView *
-                          embed<4>(model.vert(iface, nthvert));
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        return gl_Vertex;
-    }
-
-    virtual bool fragment(Model& model, vec3f bar, TGAColor& color)
-    {
-        vec4f sb_p = uniform_Mshadow *
-                     embed<4>(varying_tri * bar);  // corresponding point in the shadow buffer
-        sb_p = sb_p / sb_p[3];
-        double shadow = .3 + .7 * (shadow_buffer.get(int(sb_p[0]), int(sb_p[1])) <=
-                                   sb_p[2] + 43.34);  // magic coeff to avoid z-fighting
-        // shadow = std::max(0., shadow);
-
-        // shadow = .7 * shadow_buffer.get(int(sb_p[0]), int(sb_p[1]));
-        vec2f uv = varying_uv * bar;  // interpolate uv for the current pixel
-        vec3f n =
-            proj<3>(uniform_MIT * embed<4>(model.normal(uv).normalize())).normalize();  // normal
-        vec3f l = proj<3>(uniform_M * embed<4>(light_dir)).normalize();  // light vector
-        vec3f r = (n * (dot(n, l) * 2.) - l).normalize();                // reflected light
-        double spec = std::pow(std::max(r.z, 0.0), model.specular(uv));
-        double diff = std::max(0., dot(n, l));
-        TGAColor c = model.diffuse(uv);
-        for (int i = 0; i < 3; i++) {
-            color[i] =
-                static_cast<uint8_t>(std::min(20 + c[i] * shadow * (1.2 * diff + .6 * spec), 255.));
-            // color[i] = (uint8_t)(model.specular(uv) + 64);
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> unit(0., 1.);
+    std::vector<Light> lights(n);
+    for (size_t i = 0; i < n; i++) {
+        Light& light = lights[i];
+        double phi = 2 * M_PI * unit(rng), z = 2 * unit(rng) - 1, r = 1.1 + .4 * unit(rng);
+        double s = std::sqrt(1 - z * z);
+        light.position = vec3f(s * std::cos(phi), s * std::sin(phi), z) * r;
+        light.color = vec3f(unit(rng), unit(rng), unit(rng)) * .4;
+        light.radius = .3 + .4 * unit(rng);
+        if (i % 2) {
+            light.direction = (light.position * -1.).normalize();
+            light.cos_cutoff = std::cos(M_PI / 6);
+            light.radius *= 1.5;
         }
-
-        return false;
     }
-};
+    return lights;
+}
 
 int main()
 {
-    Model model{"obj/african_head.obj", true, true, true};
+    // the shadow pass only needs the geometry, so it runs while the textures are still decoding
+    ModelLoad load = Model::load_async("obj/african_head.obj", true, true, true);
+    if (!load.geometry.get()) return 1;
+    Model& model = *load.model;
+    model.set_texture_filter(TextureFilter::Trilinear);
 
     light_dir = light_dir.normalize();
 
-    mat4 ModelView = lookat(light_dir, center, up);
-    mat4 Viewport = viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-    mat4 Projection = projection(0);
+    TGAImage image(width, height, TGAImage::RGB);
+    // the shadow pass only has to resolve self shadowing, the main pass gets float precision
+    DepthBuffer<ReverseZ<DepthFloat32>> zbuffer(width, height, true);
 
-    mat4 M = Viewport * Projection * ModelView;
+    // the light and the model don't move between renders, so the shadow map is usually cached
+    auto &shadow_cache = ShadowMapCache<DepthUnorm16>::instance();
+    shadow_cache.set_directory(shadow_cache_dir);
+    std::shared_ptr<const ShadowMap<DepthUnorm16>> shadow =
+        shadow_cache.get(model, light_dir, up, shadow_size, shadow_size);
+    const ShadowMap<DepthUnorm16> &shadow_map = *shadow;
+    if (shadow_debug_image) shadow_map.buffer().write("depth.tga");
 
-    TGAImage image(width, height, TGAImage::RGB);
-    DepthBuffer zbuffer(width, height);
-    DepthBuffer shadow_buffer(width, height);
-
-    {  // rendering the shadow buffer
-        TGAImage shadow_texture(width, height, TGAImage::RGB);
-        DepthShader depth_shader;
-        depth_shader.uniform_ModelView = ModelView;
-        depth_shader.uniform_Viewport = Viewport;
-        depth_shader.uniform_Projection = Projection;
-        std::array<vec4f, 3> screen_coords;
+    load.textures.wait();
+    mat4 ModelView = lookat(eye, center, up);
+    mat4 Viewport = viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
+    mat4 Projection = projection(-1. / (eye - center).norm());
+
+    mat4 Screen = Viewport * Projection * ModelView;
+    mat4 MIT = (Projection * ModelView).invert_transpose();
+    mat4 Mshadow = shadow_map.transform() * Screen.invert();
+    std::vector<Light> lights = scatter_lights(local_light_count);
+    LightGrid light_grid;
+    auto bin_lights = [&](Shader<DepthUnorm16>& shader) {
+        light_grid.build(lights, zbuffer, Screen);
+        shader.uniform_lights = &lights;
+        shader.light_grid = &light_grid;
+        shader.uniform_eye = eye;
+        shader.uniform_Screen_inv = Screen.invert();
+    };
+    auto place = [&](IShader& shader) {
+        shader.uniform_ModelView = ModelView;
+        shader.uniform_Viewport = Viewport;
+        shader.uniform_Projection = Projection;
+    };
+    auto draw = [&](IShader& shader, auto&... targets) {
+        place(shader);
         for (size_t i = 0; i < model.nfaces(); i++) {
+            std::array<vec4f, 3> screen_coords;
             for (size_t j = 0; j < 3; j++) {
-                screen_coords[j] = depth_shader.vertex(model, i, j);
+                screen_coords[j] = shader.vertex(model, static_cast<int>(i), static_cast<int>(j));
             }
-            triangle(model, screen_coords, depth_shader, shadow_texture, shadow_buffer);
+            triangle(model, screen_coords, shader, targets...);
         }
-        shadow_texture.write_tga_file("depth.tga");
-    }
+    };
 
-    ModelView = lookat(eye, center, up);
-    Viewport = viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-    Projection = projection(-1. / (eye - center).norm());
-
-    Shader shader{ModelView, (Projection * ModelView).invert_transpose(),
-                  M * (Viewport * Projection * ModelView).invert(), shadow_buffer};
-    shader.uniform_ModelView = ModelView;
-    shader.uniform_Viewport = Viewport;
-    shader.uniform_Projection = Projection;
-    for (size_t i = 0; i < model.nfaces(); i++) {
-        std::array<vec4f, 3> screen_coords;
-        for (size_t j = 0; j < 3; j++) {
-            screen_coords[j] = shader.vertex(model, i, j);
+    if (shading_path == ShadingPath::Deferred && relight_steps > 0) {
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed_ms = [&]() {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                             start)
+                .count();
+        };
+        Relighter relighter(model, ModelView, Projection, Viewport, width, height, shadow_size);
+        std::cerr << "surface cache: " << elapsed_ms() << " ms" << std::endl;
+        for (size_t i = 0; i < relight_steps; i++) {
+            // swept around the vertical axis
+            double a = 2 * M_PI * static_cast<double>(i) / static_cast<double>(relight_steps);
+            vec3f dir(light_dir.x * std::cos(a) + light_dir.z * std::sin(a), light_dir.y,
+                      light_dir.z * std::cos(a) - light_dir.x * std::sin(a));
+            start = std::chrono::steady_clock::now();
+            image.clear();
+            relighter.relight(dir, image);
+            std::cerr << "relight " << i << ": " << elapsed_ms() << " ms" << std::endl;
+            image.write_tga_file("relight_" + std::to_string(i) + ".tga");
+        }
+    } else if (shading_path == ShadingPath::Deferred) {
+        // the raster pass only fills the G-buffer, lighting then runs once per covered pixel
+        RenderTargets gbuffer(width, height, gbuffer_formats);
+        GBufferShader geometry{MIT};
+        draw(geometry, gbuffer, zbuffer);
+        DeferredShader lighting{ModelView, Mshadow, light_dir, shadow_map};
+        lighting_pass(gbuffer, zbuffer, lighting, image);
+    } else if (shading_path == ShadingPath::Visibility && orbit_frames > 0) {
+        ReprojectionCache cache(width, height);
+        cache.validate = orbit_error_check;
+        VisibilityBuffer vis(width, height);
+        for (size_t f = 0; f < orbit_frames; f++) {
+            double a = orbit_step * M_PI / 180 * static_cast<double>(f);
+            vec3f e(eye.x * std::cos(a) + eye.z * std::sin(a), eye.y,
+                    eye.z * std::cos(a) - eye.x * std::sin(a));
+            mat4 FrameView = lookat(e, center, up);
+            mat4 FrameScreen = Viewport * Projection * FrameView;
+            Shader shader = camera_shader(FrameView, Projection, Viewport, light_dir, shadow_map);
+            auto start = std::chrono::steady_clock::now();
+            vis.clear();
+            zbuffer.clear();
+            visibility_pass(model, 0, shader, vis, zbuffer);
+            image.clear();
+            ReprojectionStats rs =
+                cache.resolve(vis, zbuffer, FrameScreen, {{&model, &shader}}, image);
+            std::cerr << "frame " << f << ": " << rs.reuse_ratio * 100 << "% reused, "
+                      << rs.disoccluded << " disoccluded, " << rs.rejected << " rejected, "
+                      << rs.stale << " stale, " << rs.drifted << " drifted";
+            if (orbit_error_check)
+                std::cerr << ", error " << rs.mean_error << " mean, " << rs.max_error << " max";
+            std::cerr << ", "
+                      << std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count()
+                      << " ms" << std::endl;
+        }
+    } else if (shading_path == ShadingPath::Visibility ||
+               shading_path == ShadingPath::Progressive) {
+        // the raster pass only stores face ids, the shader then runs once per covered pixel
+        auto start = std::chrono::steady_clock::now();
+        Shader shader = camera_shader(ModelView, Projection, Viewport, light_dir, shadow_map);
+        VisibilityBuffer vis(width, height);
+        visibility_pass(model, 0, shader, vis, zbuffer);
+        if (!lights.empty()) bin_lights(shader);
+        if (shading_path == ShadingPath::Progressive) {
+            auto preview = [&](const TGAImage &partial, const ProgressivePass &pass) {
+                std::string filename = "progressive_" + std::to_string(pass.index) + ".tga";
+                partial.write_tga_file(filename);
+                std::cerr << "pass " << pass.index + 1 << "/" << pass.passes << ", spacing "
+                          << pass.spacing << ": " << pass.resolved << " pixels resolved, "
+                          << std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count()
+                          << " ms" << std::endl;
+            };
+            resolve_visibility_progressive(vis, {{&model, &shader}}, image, progressive_step,
+                                           preview);
+        } else {
+            resolve_visibility(vis, {{&model, &shader}}, image);
+        }
+        size_t face, instance;
+        if (vis.pick(width / 2, height / 2, face, instance))
+            std::cerr << "face " << face << " at the center of the frame" << std::endl;
+    } else if (msaa_samples > 1) {
+        // coverage and depth per sample, the shader once per pixel and triangle
+        Shader shader = camera_shader(ModelView, Projection, Viewport, light_dir, shadow_map);
+        MultisampleBuffer<ReverseZ<DepthFloat32>> msaa(width, height, msaa_samples);
+        draw(shader, msaa);
+        msaa.resolve(image);
+        msaa.resolve_depth(zbuffer);
+        MultisampleStats ms = msaa.stats;
+        std::cerr << msaa.get_samples() << "x MSAA: " << ms.fragments
+                  << " fragment shader runs, supersampling would run " << ms.shaded_samples << " ("
+                  << static_cast<double>(ms.shaded_samples) / static_cast<double>(ms.fragments)
+                  << "x)" << std::endl;
+    } else if (frame_budget_ms > 0) {
+        ResolutionController controller(frame_budget_ms);
+        // a settled controller keeps the same size, so its frames reuse the same buffers
+        FramebufferPool<ReverseZ<DepthFloat32>> pool(true);
+        for (size_t f = 0; f < budget_frames; f++) {
+            auto start = std::chrono::steady_clock::now();
+            size_t w = controller.scaled(width), h = controller.scaled(height);
+            int iw = static_cast<int>(w), ih = static_cast<int>(h);
+            mat4 ScaledViewport = viewport(iw / 8, ih / 8, iw * 3 / 4, ih * 3 / 4);
+            Shader shader =
+                camera_shader(ModelView, Projection, ScaledViewport, light_dir, shadow_map);
+            auto frame = pool.acquire(w, h, TGAImage::RGB);
+            for (size_t i = 0; i < model.nfaces(); i++) {
+                std::array<vec4f, 3> screen_coords;
+                for (size_t j = 0; j < 3; j++)
+                    screen_coords[j] =
+                        shader.vertex(model, static_cast<int>(i), static_cast<int>(j));
+                triangle(model, screen_coords, shader, frame->color, frame->depth);
+            }
+            resample(frame->color.resolve(), image, width, height, ResampleFilter::Bilinear);
+            pool.release(std::move(frame));
+            controller.record(std::chrono::duration<double, std::milli>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count());
+            const FrameTime &t = controller.history().back();
+            std::cerr << "frame " << f << ": " << w << "x" << h << " (scale " << t.scale << "), "
+                      << t.ms << " ms" << std::endl;
+        }
+        std::cerr << "framebuffers: " << pool.get_allocations() << " allocated, "
+                  << pool.get_reuses() << " reused" << std::endl;
+    } else {
+        Shader shader = camera_shader(ModelView, Projection, Viewport, light_dir, shadow_map);
+        ShadingRateMap rates(width, height, shading_rate);
+        if (!lights.empty() || adaptive_shading_rate) {
+            // depth pre-pass, so the lights are binned by the depth range of the visible surfaces
+            // and the shading rates follow the curvature of the visible surfaces
+            depth_pass(model, Screen, zbuffer);
+            if (!lights.empty()) bin_lights(shader);
+            if (adaptive_shading_rate) rates.adapt(zbuffer);
+        }
+        if (adaptive_shading_rate || shading_rate != ShadingRate::Full)
+            shader.shading_rate = &rates;
+        draw(shader, image, zbuffer);
+        if (shader.shading_rate) {
+            ShadingRateStats rs = rates.stats;
+            std::cerr << "shading rate: " << rates.count(ShadingRate::Full) << " full, "
+                      << rates.count(ShadingRate::Coarse2x2) << " 2x2, "
+                      << rates.count(ShadingRate::Coarse4x4) << " 4x4 tiles; "
+                      << rs.invocations << " fragment shader runs for " << rs.pixels
+                      << " pixels" << std::endl;
         }
-        triangle(model, screen_coords, shader, image, zbuffer);
     }
 
     image.write_tga_file("output.tga");
     zbuffer.write("zbuffer.tga");
 
+    ShadowCacheStats stats = shadow_cache.stats();
+    std::cerr << "shadow map cache: " << stats.hits << " hits, " << stats.disk_hits
+              << " disk hits, " << stats.misses << " misses, " << stats.evictions
+              << " evictions, " << stats.resident_bytes / 1024 << " KiB resident" << std::endl;
+
+    if (!lights.empty()) {
+        LightGridStats grid = light_grid.stats();
+        std::cerr << "light grid: " << lights.size() << " lights, " << grid.average_lights
+                  << " per covered tile on average, " << grid.max_lights << " at most; "
+                  << grid.evaluations << " light evaluations instead of "
+                  << grid.brute_force_evaluations << std::endl;
+    }
+
     return 0;
 }
\ No newline at end of file
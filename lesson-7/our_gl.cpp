@@ -1,27 +1,392 @@
 #include "our_gl.h"
 
 #include <cmath>
+#include <cstring>
+#include <iostream>
 #include <limits>
 #include <cstdlib>
 
 IShader::~IShader() {}
 
-DepthBuffer::DepthBuffer(size_t width, size_t height)
-    : width(width), height(height), data(width * height, -std::numeric_limits<double>::max())
+vec4f IShader::vertex_fetched(const VertexAttributes &in, int)
+{
+    return uniform_Viewport * uniform_Projection * uniform_ModelView * embed<4>(in.position);
+}
+
+bool IShader::fragment(Model &, vec3f, TGAColor &) { return true; }
+
+bool IShader::fragment_targets(Model &, vec3f, FragmentOutputs &) { return true; }
+
+ILightingShader::~ILightingShader() {}
+
+ColorBuffer::ColorBuffer(size_t width, size_t height, size_t bytespp)
+    : img(width, height, bytespp),
+      tiles_x((width + tile_size - 1) / tile_size),
+      tile_generation(tiles_x * ((height + tile_size - 1) / tile_size), 0)
 {}
-double DepthBuffer::get(size_t x, size_t y) const { return data[x * width + y]; }
-void DepthBuffer::set(size_t x, size_t y, double value) { data[x * width + y] = value; }
 
-void DepthBuffer::write(const char *filename) const
+size_t ColorBuffer::get_width() const { return img.get_width(); }
+
+size_t ColorBuffer::get_height() const { return img.get_height(); }
+
+size_t ColorBuffer::get_bytespp() const { return img.get_bytespp(); }
+
+void ColorBuffer::fill_tile(size_t t)
+{
+    size_t x0 = (t % tiles_x) * tile_size, y0 = (t / tiles_x) * tile_size;
+    size_t x1 = std::min(x0 + tile_size, img.get_width());
+    size_t y1 = std::min(y0 + tile_size, img.get_height());
+    size_t bpp = img.get_bytespp();
+    for (size_t y = y0; y < y1; y++) {
+        std::uint8_t *p = img.buffer() + (x0 + y * img.get_width()) * bpp;
+        for (size_t x = x0; x < x1; x++, p += bpp)
+            std::copy(clear_color.bgra, clear_color.bgra + bpp, p);
+    }
+    tile_generation[t] = generation;
+}
+
+TGAColor ColorBuffer::get(size_t x, size_t y) const
+{
+    if (x >= get_width() || y >= get_height()) return {};
+    if (tile_generation[(y / tile_size) * tiles_x + x / tile_size] != generation)
+        return TGAColor(clear_color.bgra, static_cast<std::uint8_t>(img.get_bytespp()));
+    return img.get(x, y);
+}
+
+void ColorBuffer::set(size_t x, size_t y, const TGAColor &c)
+{
+    if (x >= get_width() || y >= get_height()) return;
+    size_t t = (y / tile_size) * tiles_x + x / tile_size;
+    if (tile_generation[t] != generation) fill_tile(t);
+    img.set(x, y, c);
+}
+
+void ColorBuffer::clear(const TGAColor &c)
+{
+    clear_color = c;
+    if (++generation) return;
+    // the counter wrapped around, clear every tile for real
+    for (size_t t = 0; t < tile_generation.size(); t++) fill_tile(t);
+}
+
+const TGAImage &ColorBuffer::resolve()
+{
+    for (size_t t = 0; t < tile_generation.size(); t++)
+        if (tile_generation[t] != generation) fill_tile(t);
+    return img;
+}
+
+RenderTargets::RenderTargets(size_t width, size_t height, const std::vector<TargetFormat> &formats)
+    : width(width), height(height)
+{
+    if (formats.size() > max_render_targets)
+        std::cerr << "at most " << max_render_targets << " render targets, ignoring the rest\n";
+    for (size_t i = 0; i < std::min(formats.size(), max_render_targets); i++)
+        targets.push_back(
+            {formats[i], std::vector<std::uint8_t>(width * height * bytespp(formats[i]))});
+}
+
+size_t RenderTargets::bytespp(TargetFormat format) { return format == TargetFormat::R8 ? 1 : 4; }
+
+size_t RenderTargets::get_width() const { return width; }
+
+size_t RenderTargets::get_height() const { return height; }
+
+size_t RenderTargets::count() const { return targets.size(); }
+
+TargetFormat RenderTargets::format(size_t target) const { return targets[target].format; }
+
+size_t RenderTargets::memory_bytes() const
+{
+    size_t total = 0;
+    for (auto &t : targets) total += t.data.size();
+    return total;
+}
+
+vec4f RenderTargets::get(size_t target, size_t x, size_t y) const
 {
-    TGAImage image(width, height, TGAImage::GRAYSCALE);
-    for (size_t i = 0; i < width; i++) {
-        for (size_t j = 0; j < height; j++) {
-            image.set(i, j, TGAColor(static_cast<uint8_t>(data[i * width + j])));
+    const Target &t = targets[target];
+    const std::uint8_t *p = t.data.data() + (x + y * width) * bytespp(t.format);
+    vec4f v;
+    switch (t.format) {
+        case TargetFormat::R8: v[0] = p[0] / 255.; break;
+        case TargetFormat::RGBA8:
+            for (size_t i = 0; i < 4; i++) v[i] = p[i] / 255.;
+            break;
+        case TargetFormat::RG16: {
+            std::uint16_t c[2];
+            std::memcpy(c, p, sizeof(c));
+            v[0] = c[0] / 65535., v[1] = c[1] / 65535.;
+            break;
+        }
+        case TargetFormat::RG16Snorm: {
+            std::int16_t c[2];
+            std::memcpy(c, p, sizeof(c));
+            v[0] = c[0] / 32767., v[1] = c[1] / 32767.;
+            break;
+        }
+        case TargetFormat::R32F: {
+            float f;
+            std::memcpy(&f, p, sizeof(f));
+            v[0] = f;
+            break;
+        }
+    }
+    return v;
+}
+
+void RenderTargets::get(size_t x, size_t y, FragmentOutputs &out) const
+{
+    for (size_t i = 0; i < targets.size(); i++) out[i] = get(i, x, y);
+}
+
+void RenderTargets::set(size_t x, size_t y, const FragmentOutputs &out)
+{
+    auto unorm = [](double v, double max) { return std::lround(clamp(v, 0., 1.) * max); };
+    for (size_t i = 0; i < targets.size(); i++) {
+        Target &t = targets[i];
+        std::uint8_t *p = t.data.data() + (x + y * width) * bytespp(t.format);
+        const vec4f &v = out[i];
+        switch (t.format) {
+            case TargetFormat::R8: p[0] = static_cast<std::uint8_t>(unorm(v[0], 255.)); break;
+            case TargetFormat::RGBA8:
+                for (size_t k = 0; k < 4; k++) p[k] = static_cast<std::uint8_t>(unorm(v[k], 255.));
+                break;
+            case TargetFormat::RG16: {
+                std::uint16_t c[2] = {static_cast<std::uint16_t>(unorm(v[0], 65535.)),
+                                      static_cast<std::uint16_t>(unorm(v[1], 65535.))};
+                std::memcpy(p, c, sizeof(c));
+                break;
+            }
+            case TargetFormat::RG16Snorm: {
+                std::int16_t c[2];
+                for (size_t k = 0; k < 2; k++)
+                    c[k] = static_cast<std::int16_t>(std::lround(clamp(v[k], -1., 1.) * 32767.));
+                std::memcpy(p, c, sizeof(c));
+                break;
+            }
+            case TargetFormat::R32F: {
+                float f = static_cast<float>(v[0]);
+                std::memcpy(p, &f, sizeof(f));
+                break;
+            }
         }
     }
-    image.write_tga_file(filename);
 }
+
+void RenderTargets::clear()
+{
+    for (auto &t : targets) std::fill(t.data.begin(), t.data.end(), std::uint8_t(0));
+}
+
+const std::vector<vec2f> &sample_pattern(size_t samples)
+{
+    // the usual positions on a 16x16 grid over the pixel, rotated so that no two samples share a
+    // row or a column
+    static const std::vector<vec2f> none, x1 = {vec2f(0, 0)},
+                                          x2 = {vec2f(4, 4) / 16., vec2f(-4, -4) / 16.},
+                                          x4 = {vec2f(-2, -6) / 16., vec2f(6, -2) / 16.,
+                                                vec2f(-6, 2) / 16., vec2f(2, 6) / 16.},
+                                          x8 = {vec2f(1, -3) / 16., vec2f(-1, 3) / 16.,
+                                                vec2f(5, 1) / 16., vec2f(-3, -5) / 16.,
+                                                vec2f(-5, 5) / 16., vec2f(-7, -1) / 16.,
+                                                vec2f(3, 7) / 16., vec2f(7, -7) / 16.};
+    switch (samples) {
+        case 1: return x1;
+        case 2: return x2;
+        case 4: return x4;
+        case 8: return x8;
+        default: return none;
+    }
+}
+
+ShadingRateMap::ShadingRateMap(size_t width, size_t height, ShadingRate rate)
+    : tiles_x((width + tile_size - 1) / tile_size),
+      tiles_y((height + tile_size - 1) / tile_size),
+      rates(tiles_x * tiles_y, rate)
+{}
+
+size_t ShadingRateMap::get_tiles_x() const { return tiles_x; }
+
+size_t ShadingRateMap::get_tiles_y() const { return tiles_y; }
+
+ShadingRate ShadingRateMap::get(size_t x, size_t y) const
+{
+    return rates[y / tile_size * tiles_x + x / tile_size];
+}
+
+void ShadingRateMap::set_tile(size_t tx, size_t ty, ShadingRate rate)
+{
+    rates[ty * tiles_x + tx] = rate;
+}
+
+void ShadingRateMap::fill(ShadingRate rate) { std::fill(rates.begin(), rates.end(), rate); }
+
+size_t ShadingRateMap::count(ShadingRate rate) const
+{
+    return static_cast<size_t>(std::count(rates.begin(), rates.end(), rate));
+}
+
+void ShadingRateMap::adapt(const TGAImage &image, double coarse4, double coarse2)
+{
+    size_t width = image.get_width(), height = image.get_height();
+    auto luminance = [&](size_t x, size_t y) {
+        TGAColor c = image.get(x, y);
+        if (image.get_bytespp() == 1) return static_cast<double>(c[0]);
+        return .0722 * c[0] + .7152 * c[1] + .2126 * c[2];  // blue first
+    };
+    for (size_t ty = 0; ty < tiles_y; ty++)
+        for (size_t tx = 0; tx < tiles_x; tx++) {
+            double metric = 0;
+            for (size_t y = ty * tile_size; y < std::min((ty + 1) * tile_size, height); y++)
+                for (size_t x = tx * tile_size; x < std::min((tx + 1) * tile_size, width); x++) {
+                    double l = luminance(x, y);
+                    if (x + 1 < width)
+                        metric = std::max(metric, std::abs(luminance(x + 1, y) - l));
+                    if (y + 1 < height)
+                        metric = std::max(metric, std::abs(luminance(x, y + 1) - l));
+                }
+            set_tile(tx, ty, classify(metric, coarse4, coarse2));
+        }
+}
+
+ResolutionController::ResolutionController(double target_ms, double min_scale, double max_scale)
+    : target_ms(target_ms), min_scale(min_scale), max_scale(max_scale), scale(max_scale)
+{}
+
+double ResolutionController::get_scale() const { return scale; }
+
+size_t ResolutionController::scaled(size_t size) const
+{
+    return std::max<size_t>(1, static_cast<size_t>(std::lround(static_cast<double>(size) * scale)));
+}
+
+void ResolutionController::record(double ms)
+{
+    history_.push_back({scale, ms});
+    double full = ms / (scale * scale);
+    full_ms = history_.size() == 1 ? full : smoothing * full_ms + (1 - smoothing) * full;
+    if (full_ms <= 0) return;
+    double ideal = std::sqrt(target_ms / full_ms);
+    scale = std::round((scale + gain * (ideal - scale)) / scale_step) * scale_step;
+    scale = std::max(min_scale, std::min(max_scale, scale));
+}
+
+const std::vector<FrameTime> &ResolutionController::history() const { return history_; }
+
+std::uint32_t VisibilityBuffer::pack(size_t face, size_t instance)
+{
+    return static_cast<std::uint32_t>(instance << 24 | face);
+}
+
+VisibilityBuffer::VisibilityBuffer(size_t width, size_t height)
+    : width(width), height(height), ids(width * height, none)
+{}
+
+size_t VisibilityBuffer::get_width() const { return width; }
+
+size_t VisibilityBuffer::get_height() const { return height; }
+
+std::uint32_t VisibilityBuffer::get(size_t x, size_t y) const { return ids[x + y * width]; }
+
+void VisibilityBuffer::set(size_t x, size_t y, std::uint32_t id) { ids[x + y * width] = id; }
+
+void VisibilityBuffer::clear() { std::fill(ids.begin(), ids.end(), none); }
+
+bool VisibilityBuffer::pick(size_t x, size_t y, size_t &face, size_t &instance) const
+{
+    if (x >= width || y >= height) return false;
+    std::uint32_t id = get(x, y);
+    if (id == none) return false;
+    face = id & (max_faces - 1);
+    instance = id >> 24;
+    return true;
+}
+
+double Light::attenuation(const vec3f &p) const
+{
+    vec3f d = p - position;
+    double t = d.norm() / radius;
+    if (t >= 1.) return 0.;
+    double a = (1. - t * t) * (1. - t * t);
+    if (cos_cutoff > -1.) {
+        double c = dot(d, direction) / std::max(d.norm(), 1e-12);
+        // fades over the outer tenth of the cone
+        a *= clamp((c - cos_cutoff) / std::max(.1 * (1. - cos_cutoff), 1e-12), 0., 1.);
+    }
+    return a;
+}
+
+void LightGrid::tile_bounds(const mat4 &screen_inverse, double x0, double y0, double x1,
+                            double y1, double zmin, double zmax, vec3f &lo, vec3f &hi)
+{
+    lo = vec3f(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+               std::numeric_limits<double>::max());
+    hi = lo * -1.;
+    for (double x : {x0, x1})
+        for (double y : {y0, y1})
+            for (double z : {zmin, zmax}) {
+                vec4f v = screen_inverse * embed<4>(vec3f(x, y, z));
+                vec3f w = proj<3>(v / v[3]);
+                for (size_t k = 0; k < 3; k++) {
+                    lo[k] = std::min(lo[k], w[k]);
+                    hi[k] = std::max(hi[k], w[k]);
+                }
+            }
+}
+
+void LightGrid::bin(const std::vector<Light> &lights, const mat4 &screen_inverse,
+                    const std::vector<double> &zmin, const std::vector<double> &zmax,
+                    const std::vector<size_t> &covered)
+{
+    offsets.assign(1, 0);
+    indices.clear();
+    stats_ = LightGridStats();
+    stats_.tiles = tiles_x * tiles_y;
+    for (size_t t = 0; t < tiles_x * tiles_y; t++) {
+        if (covered[t]) {
+            // pixel centers of the tile, widened by half a pixel
+            double x0 = static_cast<double>(t % tiles_x * tile_size) - .5;
+            double y0 = static_cast<double>(t / tiles_x * tile_size) - .5;
+            double size = static_cast<double>(tile_size);
+            vec3f lo, hi;
+            tile_bounds(screen_inverse, x0, y0, x0 + size, y0 + size, zmin[t], zmax[t], lo, hi);
+            size_t first = indices.size();
+            for (size_t i = 0; i < lights.size(); i++) {
+                // squared distance from the light to the box
+                double d2 = 0;
+                for (size_t k = 0; k < 3; k++) {
+                    double c = lights[i].position[k];
+                    double d = c < lo[k] ? lo[k] - c : (c > hi[k] ? c - hi[k] : 0.);
+                    d2 += d * d;
+                }
+                if (d2 < lights[i].radius * lights[i].radius)
+                    indices.push_back(static_cast<std::uint32_t>(i));
+            }
+            size_t n = indices.size() - first;
+            stats_.covered_tiles++;
+            stats_.max_lights = std::max(stats_.max_lights, n);
+            stats_.evaluations += covered[t] * n;
+            stats_.brute_force_evaluations += covered[t] * lights.size();
+        }
+        offsets.push_back(static_cast<std::uint32_t>(indices.size()));
+    }
+    if (stats_.covered_tiles)
+        stats_.average_lights =
+            static_cast<double>(indices.size()) / static_cast<double>(stats_.covered_tiles);
+}
+
+std::pair<const std::uint32_t *, const std::uint32_t *> LightGrid::lights(size_t x,
+                                                                           size_t y) const
+{
+    if (offsets.size() < 2) return {nullptr, nullptr};  // not built
+    size_t t = std::min(y / tile_size, tiles_y - 1) * tiles_x;
+    t += std::min(x / tile_size, tiles_x - 1);
+    return {indices.data() + offsets[t], indices.data() + offsets[t + 1]};
+}
+
+LightGridStats LightGrid::stats() const { return stats_; }
+
 mat4 viewport(int x, int y, int w, int h)
 {
     mat4 Viewport = mat4::identity();
@@ -72,32 +437,515 @@ vec3f barycentric(vec2f A, vec2f B, vec2f C, vec2f P)
                              // away by the rasterizer
 }
 
-void triangle(Model &model, std::array<vec4f, 3> pts, IShader &shader, TGAImage &image,
-              DepthBuffer &zbuffer)
+// pixel bounding box of the projected triangle, clamped to a width x height target
+static void bounding_box(const std::array<vec2f, 3> &pts2, size_t width, size_t height, int &xmin,
+                         int &xmax, int &ymin, int &ymax)
 {
     vec2f bboxmin(std::numeric_limits<double>::max(), std::numeric_limits<double>::max());
     vec2f bboxmax(-std::numeric_limits<double>::max(), -std::numeric_limits<double>::max());
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 2; j++) {
-            bboxmin[j] = std::min(bboxmin[j], pts[i][j] / pts[i][3]);
-            bboxmax[j] = std::max(bboxmax[j], pts[i][j] / pts[i][3]);
+    vec2f clampmax(static_cast<double>(width - 1), static_cast<double>(height - 1));
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 2; j++) {
+            bboxmin[j] = std::max(0., std::min(bboxmin[j], pts2[i][j]));
+            bboxmax[j] = std::min(clampmax[j], std::max(bboxmax[j], pts2[i][j]));
+        }
+    }
+    xmin = static_cast<int>(bboxmin.x), xmax = static_cast<int>(bboxmax.x);
+    ymin = static_cast<int>(bboxmin.y), ymax = static_cast<int>(bboxmax.y);
+}
+
+// z/w is affine in screen space, so the depth of a triangle is the plane through its projected
+// vertices; the .5 offset is the rounding that the 8 bit depth images had always used
+DepthPlane depth_plane(const std::array<vec4f, 3> &pts)
+{
+    vec3f p[3];
+    for (size_t i = 0; i < 3; i++) p[i] = proj<3>(pts[i] / pts[i][3]);
+    vec3f n = cross(p[1] - p[0], p[2] - p[0]);
+    DepthPlane plane;
+    if (std::abs(n.z) < 1e-12) return plane;  // degenerate, the rasterizer skips it anyway
+    plane.a = -n.x / n.z;
+    plane.b = -n.y / n.z;
+    plane.c = p[0].z - plane.a * p[0].x - plane.b * p[0].y + .5;
+    return plane;
+}
+
+// the fragment function and output that go with each kind of target
+template <class Target>
+struct TargetOutput
+{
+    using type = TGAColor;
+};
+template <>
+struct TargetOutput<RenderTargets>
+{
+    using type = FragmentOutputs;
+};
+
+static bool shade(IShader &shader, Model &model, vec3f bar, TGAColor &color)
+{
+    return shader.fragment(model, bar, color);
+}
+
+static bool shade(IShader &shader, Model &model, vec3f bar, FragmentOutputs &out)
+{
+    return shader.fragment_targets(model, bar, out);
+}
+
+template <class Format, class Target>
+void triangle(Model &model, std::array<vec4f, 3> pts, IShader &shader, Target &image,
+              DepthBuffer<Format> &zbuffer)
+{
+    std::array<vec2f, 3> pts2;
+    for (size_t i = 0; i < 3; i++) pts2[i] = proj<2, 4>(pts[i] / pts[i][3]);
+    int xmin, xmax, ymin, ymax;
+    bounding_box(pts2, image.get_width(), image.get_height(), xmin, xmax, ymin, ymax);
+    typename TargetOutput<Target>::type color{};
+    DepthPlane plane = depth_plane(pts);
+    // walk the bounding box one depth buffer tile at a time, and every tile in aligned 2x2 quads
+    // so the fragment shader gets the barycentric derivatives, which is what texture lookups use
+    // to pick a mip level
+    const int tile = static_cast<int>(DepthBuffer<Format>::tile_size);
+    for (int ty = ymin & -tile; ty <= ymax; ty += tile) {
+        for (int tx = xmin & -tile; tx <= xmax; tx += tile) {
+            int qymax = std::min(ty + tile - 1, ymax), qxmax = std::min(tx + tile - 1, xmax);
+            double nearest = 0;  // the plane is affine, its maximum is at a corner
+            for (int cx : {std::max(tx, xmin), qxmax})
+                for (int cy : {std::max(ty, ymin), qymax})
+                    nearest = std::max(nearest, plane.at(cx, cy));
+            size_t ptx = static_cast<size_t>(tx), pty = static_cast<size_t>(ty);
+            if (zbuffer.occludes(ptx, pty, Format::encode(nearest))) continue;
+            ShadingRateMap *rates = shader.shading_rate;
+            int rate = rates ? static_cast<int>(rates->get(ptx, pty)) : 1;
+            if (rate > 1) {
+                // one fragment shader run per rate x rate block, at the block center, or at the
+                // first pixel that passes when the center is outside of the triangle, so
+                // attributes are never extrapolated; the derivatives span the block, so the
+                // mip level matches the coarser sampling
+                double step = static_cast<double>(rate), half = (step - 1) / 2;
+                for (int by = std::max(ty, ymin & -rate); by <= qymax; by += rate) {
+                    for (int bx = std::max(tx, xmin & -rate); bx <= qxmax; bx += rate) {
+                        vec2f b(static_cast<double>(bx) + half, static_cast<double>(by) + half);
+                        vec3f center = barycentric(pts2[0], pts2[1], pts2[2], b);
+                        shader.bar_dx =
+                            barycentric(pts2[0], pts2[1], pts2[2], b + vec2f(step, 0)) - center;
+                        shader.bar_dy =
+                            barycentric(pts2[0], pts2[1], pts2[2], b + vec2f(0, step)) - center;
+                        bool inside = center.x >= 0 && center.y >= 0 && center.z >= 0;
+                        bool shaded = false, discard = false;
+                        int bymax = std::min(by + rate - 1, qymax);
+                        int bxmax = std::min(bx + rate - 1, qxmax);
+                        for (int y = std::max(by, ymin); y <= bymax && !discard; y++) {
+                            for (int x = std::max(bx, xmin); x <= bxmax; x++) {
+                                vec3f c = barycentric(pts2[0], pts2[1], pts2[2],
+                                                      vec2f(static_cast<double>(x),
+                                                            static_cast<double>(y)));
+                                if (c.x < 0 || c.y < 0 || c.z < 0) continue;
+                                size_t px = static_cast<size_t>(x), py = static_cast<size_t>(y);
+                                auto depth = Format::encode(plane.at(x, y));
+                                if (!Format::passes(depth, zbuffer.load(px, py))) continue;
+                                if (!shaded) {
+                                    shaded = true;
+                                    rates->stats.invocations++;
+                                    discard = shade(shader, model, inside ? center : c,
+                                                    color);
+                                    if (discard) break;
+                                }
+                                zbuffer.store(px, py, depth, &plane);
+                                image.set(px, py, color);
+                                rates->stats.pixels++;
+                            }
+                        }
+                    }
+                }
+                continue;
+            }
+            for (int qy = std::max(ty, ymin & ~1); qy <= qymax; qy += 2) {
+                for (int qx = std::max(tx, xmin & ~1); qx <= qxmax; qx += 2) {
+                    vec3f quad[4];
+                    for (int k = 0; k < 4; k++)
+                        quad[k] = barycentric(pts2[0], pts2[1], pts2[2],
+                                              vec2f(static_cast<double>(qx + (k & 1)),
+                                                    static_cast<double>(qy + (k >> 1))));
+                    shader.bar_dx = quad[1] - quad[0];
+                    shader.bar_dy = quad[2] - quad[0];
+                    for (int k = 0; k < 4; k++) {
+                        int x = qx + (k & 1), y = qy + (k >> 1);
+                        if (x < xmin || x > xmax || y < ymin || y > ymax) continue;
+                        vec3f c = quad[k];
+                        if (c.x < 0 || c.y < 0 || c.z < 0) continue;
+                        size_t px = static_cast<size_t>(x), py = static_cast<size_t>(y);
+                        auto depth = Format::encode(plane.at(x, y));
+                        if (!Format::passes(depth, zbuffer.load(px, py))) continue;
+                        bool discard = shade(shader, model, c, color);
+                        if (rates) {
+                            rates->stats.invocations++;
+                            rates->stats.pixels += !discard;
+                        }
+                        if (!discard) {
+                            zbuffer.store(px, py, depth, &plane);
+                            image.set(px, py, color);
+                        }
+                    }
+                }
+            }
         }
     }
-    vec2i P;
+}
+
+// coverage and depth are tested per sample, the fragment shader runs once per pixel and its
+// color goes to every covered sample that passes
+template <class Format>
+void triangle(Model &model, std::array<vec4f, 3> pts, IShader &shader,
+              MultisampleBuffer<Format> &target)
+{
+    std::array<vec2f, 3> pts2;
+    for (size_t i = 0; i < 3; i++) pts2[i] = proj<2, 4>(pts[i] / pts[i][3]);
+    int xmin, xmax, ymin, ymax;
+    size_t width = target.get_width(), height = target.get_height();
+    bounding_box(pts2, width, height, xmin, xmax, ymin, ymax);
+    // samples reach half a pixel out of the pixel centers the box is made of
+    xmin = std::max(xmin - 1, 0), ymin = std::max(ymin - 1, 0);
+    xmax = std::min(xmax + 1, static_cast<int>(width) - 1);
+    ymax = std::min(ymax + 1, static_cast<int>(height) - 1);
+    vec2f origin(xmin, ymin);
+    vec3f bar0 = barycentric(pts2[0], pts2[1], pts2[2], origin);
+    if (bar0.x == -1 && bar0.y == 1 && bar0.z == 1) return;  // degenerate
+    // barycentric coordinates are affine in screen space, the same derivatives hold everywhere
+    shader.bar_dx = barycentric(pts2[0], pts2[1], pts2[2], origin + vec2f(1, 0)) - bar0;
+    shader.bar_dy = barycentric(pts2[0], pts2[1], pts2[2], origin + vec2f(0, 1)) - bar0;
+    DepthPlane plane = depth_plane(pts);
+    const size_t samples = target.get_samples();
+    typename Format::type depth[8];
     TGAColor color;
-    for (P.x = static_cast<int>(bboxmin.x); P.x <= static_cast<int>(bboxmax.x); P.x++) {
-        for (P.y = static_cast<int>(bboxmin.y); P.y <= static_cast<int>(bboxmax.y); P.y++) {
-            vec3f c = barycentric(proj<2, 4>(pts[0] / pts[0][3]), proj<2, 4>(pts[1] / pts[1][3]),
-                                  proj<2, 4>(pts[2] / pts[2][3]), to_f(proj<2, 2>(P)));
-            double z = pts[0][2] * c.x + pts[1][2] * c.y + pts[2][2] * c.z;
-            double w = pts[0][3] * c.x + pts[1][3] * c.y + pts[2][3] * c.z;
-            double frag_depth = std::max(0., std::min(255., z / w + .5));
-            if (c.x < 0 || c.y < 0 || c.z < 0 || zbuffer.get(P.x, P.y) > frag_depth) continue;
-            bool discard = shader.fragment(model, c, color);
-            if (!discard) {
-                zbuffer.set(P.x, P.y, frag_depth);
-                image.set(P.x, P.y, color);
+    for (int y = ymin; y <= ymax; y++) {
+        for (int x = xmin; x <= xmax; x++) {
+            vec3f center = bar0 + shader.bar_dx * (x - xmin) + shader.bar_dy * (y - ymin);
+            size_t px = static_cast<size_t>(x), py = static_cast<size_t>(y);
+            unsigned mask = 0;
+            vec3f first;
+            for (size_t s = 0; s < samples; s++) {
+                const vec2f &o = target.offset(s);
+                vec3f c = center + shader.bar_dx * o.x + shader.bar_dy * o.y;
+                if (c.x < 0 || c.y < 0 || c.z < 0) continue;
+                target.stats.depth_tests++;
+                depth[s] = Format::encode(plane.at(x + o.x, y + o.y));
+                if (!Format::passes(depth[s], target.load(px, py, s))) continue;
+                if (!mask) first = c;
+                mask |= 1u << s;
+            }
+            if (!mask) continue;
+            vec3f bar = center.x < 0 || center.y < 0 || center.z < 0 ? first : center;
+            target.stats.fragments++;
+            if (shader.fragment(model, bar, color)) continue;
+            for (size_t s = 0; s < samples; s++) {
+                if (!(mask >> s & 1)) continue;
+                target.store(px, py, s, depth[s], color);
+                target.stats.shaded_samples++;
             }
         }
     }
 }
+
+// with vis, also writes id wherever the depth test passes
+template <class Format>
+void depth_triangle(std::array<vec4f, 3> pts, DepthBuffer<Format> &zbuffer,
+                    VisibilityBuffer *vis = nullptr, std::uint32_t id = 0)
+{
+    std::array<vec2f, 3> pts2;
+    for (size_t i = 0; i < 3; i++) pts2[i] = proj<2, 4>(pts[i] / pts[i][3]);
+    int xmin, xmax, ymin, ymax;
+    bounding_box(pts2, zbuffer.get_width(), zbuffer.get_height(), xmin, xmax, ymin, ymax);
+    DepthPlane plane = depth_plane(pts);
+    // same tiles, coverage and depths as triangle(), without the quads
+    const int tile = static_cast<int>(DepthBuffer<Format>::tile_size);
+    for (int ty = ymin & -tile; ty <= ymax; ty += tile) {
+        for (int tx = xmin & -tile; tx <= xmax; tx += tile) {
+            int y0 = std::max(ty, ymin), y1 = std::min(ty + tile - 1, ymax);
+            int x0 = std::max(tx, xmin), x1 = std::min(tx + tile - 1, xmax);
+            double nearest = 0;
+            for (int cx : {x0, x1})
+                for (int cy : {y0, y1}) nearest = std::max(nearest, plane.at(cx, cy));
+            size_t ptx = static_cast<size_t>(tx), pty = static_cast<size_t>(ty);
+            if (zbuffer.occludes(ptx, pty, Format::encode(nearest))) continue;
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    vec3f c = barycentric(pts2[0], pts2[1], pts2[2],
+                                          vec2f(static_cast<double>(x), static_cast<double>(y)));
+                    if (c.x < 0 || c.y < 0 || c.z < 0) continue;
+                    size_t px = static_cast<size_t>(x), py = static_cast<size_t>(y);
+                    auto depth = Format::encode(plane.at(x, y));
+                    if (!Format::passes(depth, zbuffer.load(px, py))) continue;
+                    zbuffer.store(px, py, depth, &plane);
+                    if (vis) vis->set(px, py, id);
+                }
+            }
+        }
+    }
+}
+
+template <class Format>
+void depth_pass(Model &model, const mat4 &transform, DepthBuffer<Format> &zbuffer)
+{
+    std::array<vec4f, 3> pts;
+    for (size_t i = 0; i < model.nfaces(); i++) {
+        for (size_t j = 0; j < 3; j++) pts[j] = transform * embed<4>(model.vert(i, j));
+        depth_triangle(pts, zbuffer);
+    }
+}
+
+template <class Format>
+void multiview_draw(Model &model, const std::vector<ViewTarget<Format>> &views, size_t nthreads)
+{
+    std::vector<VertexAttributes> corners(model.nfaces() * 3);
+    for (size_t i = 0; i < model.nfaces(); i++)
+        for (size_t j = 0; j < 3; j++) corners[i * 3 + j] = {model.vert(i, j), model.uv(i, j)};
+    parallel_for(
+        0, views.size(),
+        [&](size_t begin, size_t end) {
+            std::array<vec4f, 3> pts;
+            for (size_t v = begin; v < end; v++) {
+                const ViewTarget<Format> &view = views[v];
+                for (size_t i = 0; i < model.nfaces(); i++) {
+                    for (size_t j = 0; j < 3; j++)
+                        pts[j] = view.shader->vertex_fetched(corners[i * 3 + j],
+                                                             static_cast<int>(j));
+                    triangle(model, pts, *view.shader, *view.image, *view.zbuffer);
+                }
+            }
+        },
+        nthreads);
+}
+
+template <class Format>
+void visibility_pass(Model &model, size_t instance, IShader &shader, VisibilityBuffer &vis,
+                     DepthBuffer<Format> &zbuffer)
+{
+    if (instance >= VisibilityBuffer::max_instances ||
+        model.nfaces() > VisibilityBuffer::max_faces) {
+        std::cerr << "visibility buffer ids out of range, instance " << instance << ", "
+                  << model.nfaces() << " faces\n";
+        return;
+    }
+    std::array<vec4f, 3> pts;
+    for (size_t i = 0; i < model.nfaces(); i++) {
+        for (size_t j = 0; j < 3; j++)
+            pts[j] = shader.vertex(model, static_cast<int>(i), static_cast<int>(j));
+        depth_triangle(pts, zbuffer, &vis, VisibilityBuffer::pack(i, instance));
+    }
+}
+
+// runs the fragment shader of the face seen at (x, y), false if there's none or it discards;
+// current and pts2 cache the screen positions of the last face between calls
+static bool shade_visibility(const VisibilityBuffer &vis,
+                             const std::vector<VisibilityInstance> &instances, size_t x, size_t y,
+                             std::uint32_t &current, std::array<vec2f, 3> &pts2, TGAColor &color)
+{
+    size_t face, instance;
+    if (!vis.pick(x, y, face, instance) || instance >= instances.size()) return false;
+    const VisibilityInstance &inst = instances[instance];
+    if (vis.get(x, y) != current) {
+        current = vis.get(x, y);
+        for (size_t j = 0; j < 3; j++) {
+            vec4f v = inst.shader->vertex(*inst.model, static_cast<int>(face), static_cast<int>(j));
+            pts2[j] = proj<2, 4>(v / v[3]);
+        }
+    }
+    // barycentric coordinates are affine in screen space, so are their derivatives
+    vec2f p(static_cast<double>(x), static_cast<double>(y));
+    vec3f bar = barycentric(pts2[0], pts2[1], pts2[2], p);
+    inst.shader->bar_dx = barycentric(pts2[0], pts2[1], pts2[2], p + vec2f(1, 0)) - bar;
+    inst.shader->bar_dy = barycentric(pts2[0], pts2[1], pts2[2], p + vec2f(0, 1)) - bar;
+    return !inst.shader->fragment(*inst.model, bar, color);
+}
+
+template <class Target>
+void resolve_visibility(const VisibilityBuffer &vis,
+                        const std::vector<VisibilityInstance> &instances, Target &image)
+{
+    std::uint32_t current = VisibilityBuffer::none;
+    std::array<vec2f, 3> pts2;
+    TGAColor color;
+    for (size_t y = 0; y < vis.get_height(); y++) {
+        for (size_t x = 0; x < vis.get_width(); x++) {
+            if (shade_visibility(vis, instances, x, y, current, pts2, color))
+                image.set(x, y, color);
+        }
+    }
+}
+
+void resolve_visibility_progressive(const VisibilityBuffer &vis,
+                                    const std::vector<VisibilityInstance> &instances,
+                                    TGAImage &image, size_t step, const ProgressCallback &progress)
+{
+    size_t width = vis.get_width(), height = vis.get_height();
+    size_t spacing = 1, passes = 1;
+    while (spacing * 2 <= step) spacing *= 2, passes++;
+    std::uint32_t current = VisibilityBuffer::none;
+    std::array<vec2f, 3> pts2;
+    TGAColor color;
+    ProgressivePass pass{0, passes, spacing, 0};
+    for (; spacing; spacing /= 2, pass.index++) {
+        pass.spacing = spacing;
+        for (size_t y = 0; y < height; y += spacing) {
+            for (size_t x = 0; x < width; x += spacing) {
+                // the pixels of the coarser lattice are done
+                if (pass.index && x % (2 * spacing) == 0 && y % (2 * spacing) == 0) continue;
+                if (!shade_visibility(vis, instances, x, y, current, pts2, color))
+                    color = TGAColor();
+                pass.resolved++;
+                for (size_t by = y; by < std::min(y + spacing, height); by++)
+                    for (size_t bx = x; bx < std::min(x + spacing, width); bx++)
+                        image.set(bx, by, color);
+            }
+        }
+        if (progress) progress(image, pass);
+    }
+}
+
+ReprojectionCache::ReprojectionCache(size_t width, size_t height)
+    : width(width), height(height), color(width, height, TGAImage::RGB), ids(width, height),
+      depth(width * height), ages(width * height), offsets(width * height)
+{}
+
+void ReprojectionCache::clear() { valid = false; }
+
+template <class Format>
+ReprojectionStats ReprojectionCache::resolve(const VisibilityBuffer &vis,
+                                             const DepthBuffer<Format> &zbuffer,
+                                             const mat4 &transform,
+                                             const std::vector<VisibilityInstance> &instances,
+                                             TGAImage &image)
+{
+    ReprojectionStats stats;
+    // new screen to previous screen coordinates
+    mat4 reproject = screen * transform.invert();
+    std::vector<float> new_depth(width * height);
+    std::vector<std::uint8_t> new_ages(width * height);
+    std::vector<vec2f> new_offsets(width * height);
+    std::uint32_t current = VisibilityBuffer::none;
+    std::array<vec2f, 3> pts2;
+    TGAColor c, fresh;
+    double error_sum = 0;
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            std::uint32_t id = vis.get(x, y);
+            if (id == VisibilityBuffer::none) continue;
+            stats.pixels++;
+            size_t i = x + y * width;
+            // undo the rounding offset depth_plane() adds
+            double z = zbuffer.get(x, y) - .5;
+            new_depth[i] = static_cast<float>(z);
+            bool reuse = false;
+            if (valid) {
+                vec4f h = reproject * embed<4>(vec3f(static_cast<double>(x),
+                                                     static_cast<double>(y), z));
+                vec3f p = proj<3>(h / h[3]);
+                double rx = std::round(p.x), ry = std::round(p.y);
+                bool inside = rx >= 0 && ry >= 0 && rx < static_cast<double>(width) &&
+                              ry < static_cast<double>(height);
+                size_t px = inside ? static_cast<size_t>(rx) : 0;
+                size_t py = inside ? static_cast<size_t>(ry) : 0;
+                size_t j = px + py * width;
+                if (!inside || ids.get(px, py) != id)
+                    stats.disoccluded++;
+                else if (std::abs(depth[j] - p.z) > depth_tolerance)
+                    stats.rejected++;
+                else if (ages[j] >= max_age)
+                    stats.stale++;
+                else {
+                    // the color was shaded at offsets[j] from the previous pixel, which is
+                    // rx - p.x, ry - p.y from where this pixel lands there
+                    vec2f offset = offsets[j] + vec2f(rx - p.x, ry - p.y);
+                    if (offset.norm() > max_offset) {
+                        stats.drifted++;
+                    } else {
+                        reuse = true;
+                        c = color.get(px, py);
+                        new_ages[i] = static_cast<std::uint8_t>(ages[j] + 1);
+                        new_offsets[i] = offset;
+                    }
+                }
+            }
+            if (!reuse) {
+                if (!shade_visibility(vis, instances, x, y, current, pts2, c)) c = TGAColor();
+            } else {
+                stats.reused++;
+                if (validate) {
+                    if (!shade_visibility(vis, instances, x, y, current, pts2, fresh))
+                        fresh = TGAColor();
+                    for (size_t k = 0; k < 3; k++) {
+                        int e = std::abs(int{c[k]} - int{fresh[k]});
+                        stats.max_error = std::max(stats.max_error, e);
+                        error_sum += e;
+                    }
+                }
+            }
+            image.set(x, y, c);
+        }
+    }
+    if (stats.pixels) {
+        stats.reuse_ratio = static_cast<double>(stats.reused) / static_cast<double>(stats.pixels);
+        if (validate && stats.reused)
+            stats.mean_error = error_sum / (3. * static_cast<double>(stats.reused));
+    }
+    // what the next frame reprojects from; pixels nothing covers are never reused
+    for (size_t y = 0; y < height; y++)
+        for (size_t x = 0; x < width; x++) color.set(x, y, image.get(x, y));
+    ids = vis;
+    depth.swap(new_depth);
+    ages.swap(new_ages);
+    offsets.swap(new_offsets);
+    screen = transform;
+    valid = true;
+    return stats;
+}
+
+template void resolve_visibility(const VisibilityBuffer &, const std::vector<VisibilityInstance> &,
+                                 TGAImage &);
+template void resolve_visibility(const VisibilityBuffer &, const std::vector<VisibilityInstance> &,
+                                 ColorBuffer &);
+
+#define INSTANTIATE_TRIANGLE(Format, Target)                                                    \
+    template void triangle(Model &, std::array<vec4f, 3>, IShader &, Target &,                  \
+                           DepthBuffer<Format> &);                                              \
+    template void triangle(Model &, std::array<vec4f, 3>, IShader &, Target &,                  \
+                           DepthBuffer<ReverseZ<Format>> &);
+INSTANTIATE_TRIANGLE(DepthUnorm16, TGAImage)
+INSTANTIATE_TRIANGLE(DepthUnorm24, TGAImage)
+INSTANTIATE_TRIANGLE(DepthFloat32, TGAImage)
+INSTANTIATE_TRIANGLE(DepthFloat64, TGAImage)
+INSTANTIATE_TRIANGLE(DepthUnorm16, ColorBuffer)
+INSTANTIATE_TRIANGLE(DepthUnorm24, ColorBuffer)
+INSTANTIATE_TRIANGLE(DepthFloat32, ColorBuffer)
+INSTANTIATE_TRIANGLE(DepthFloat64, ColorBuffer)
+INSTANTIATE_TRIANGLE(DepthUnorm16, RenderTargets)
+INSTANTIATE_TRIANGLE(DepthUnorm24, RenderTargets)
+INSTANTIATE_TRIANGLE(DepthFloat32, RenderTargets)
+INSTANTIATE_TRIANGLE(DepthFloat64, RenderTargets)
+#undef INSTANTIATE_TRIANGLE
+
+#define INSTANTIATE_PASSES(Format)                                                          \
+    template void depth_pass(Model &, const mat4 &, DepthBuffer<Format> &);                     \
+    template void depth_pass(Model &, const mat4 &, DepthBuffer<ReverseZ<Format>> &);           \
+    template void triangle(Model &, std::array<vec4f, 3>, IShader &,                            \
+                           MultisampleBuffer<Format> &);                                        \
+    template void triangle(Model &, std::array<vec4f, 3>, IShader &,                            \
+                           MultisampleBuffer<ReverseZ<Format>> &);                              \
+    template void visibility_pass(Model &, size_t, IShader &, VisibilityBuffer &,               \
+                                  DepthBuffer<Format> &);                                       \
+    template void visibility_pass(Model &, size_t, IShader &, VisibilityBuffer &,               \
+                                  DepthBuffer<ReverseZ<Format>> &);                             \
+    template ReprojectionStats ReprojectionCache::resolve(                                      \
+        const VisibilityBuffer &, const DepthBuffer<Format> &, const mat4 &,                    \
+        const std::vector<VisibilityInstance> &, TGAImage &);                                   \
+    template ReprojectionStats ReprojectionCache::resolve(                                      \
+        const VisibilityBuffer &, const DepthBuffer<ReverseZ<Format>> &, const mat4 &,          \
+        const std::vector<VisibilityInstance> &, TGAImage &);                                   \
+    template void multiview_draw(Model &, const std::vector<ViewTarget<Format>> &, size_t);     \
+    template void multiview_draw(Model &, const std::vector<ViewTarget<ReverseZ<Format>>> &,    \
+                                 size_t);
+INSTANTIATE_PASSES(DepthUnorm16)
+INSTANTIATE_PASSES(DepthUnorm24)
+INSTANTIATE_PASSES(DepthFloat32)
+INSTANTIATE_PASSES(DepthFloat64)
+#undef INSTANTIATE_PASSES
@@ -1,39 +1,936 @@
 #pragma once
+#include <cstdint>
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <memory>
+#include <utility>
+#include <cmath>
+#include <functional>
+#include <iostream>
 
 #include "tgaimage.h"
 #include "geometry.h"
 #include "model.h"
+#include "parallel.h"
 
 mat4 viewport(int x, int y, int w, int h);
 mat4 projection(double coeff = 0.f);  // coeff = -1/c
 mat4 lookat(vec3f eye, vec3f center, vec3f up);
 
+class ShadingRateMap;
+
+const size_t max_render_targets = 4;
+using FragmentOutputs = std::array<vec4f, max_render_targets>;  // one value per render target
+
+// a triangle corner as fetched from the model, shared by the views of multiview_draw()
+struct VertexAttributes
+{
+    vec3f position;
+    vec2f uv;
+};
+
 struct IShader
 {
     mat4 uniform_ModelView;
     mat4 uniform_Viewport;
     mat4 uniform_Projection;
+    vec3f bar_dx;  // screen space derivatives of the barycentric coordinates, written by the
+    vec3f bar_dy;  // rasterizer for every 2x2 quad before the fragment shader runs
+    ShadingRateMap *shading_rate = nullptr;  // coarse shading of triangle(), full rate if null
 
     virtual ~IShader();
     virtual vec4f vertex(Model &model, int iface, int nthvert) = 0;
-    virtual bool fragment(Model &model, vec3f bar, TGAColor &color) = 0;
+    // the vertex shader on attributes fetched ahead of time, for draws that fetch them once for
+    // several shaders; the default only places the position
+    virtual vec4f vertex_fetched(const VertexAttributes &in, int nthvert);
+    // a shader overrides the fragment function of the targets it draws into, a color image or
+    // the RenderTargets of a deferred geometry pass; the defaults discard
+    virtual bool fragment(Model &model, vec3f bar, TGAColor &color);
+    virtual bool fragment_targets(Model &model, vec3f bar, FragmentOutputs &out);
+};
+
+// Depth formats map a depth in [0, 255] (larger is closer to the viewer, as triangle() computes
+// it) to a stored value and back. The depth test compares stored values, so a fragment is tested
+// against the buffer quantized exactly the way its own depth would be written. A cleared buffer
+// holds encode(0), which every fragment passes.
+struct DepthUnorm16
+{
+    using type = std::uint16_t;
+    static type encode(double depth) { return static_cast<type>(depth * (65535. / 255.) + .5); }
+    static double decode(type value) { return value * (255. / 65535.); }
+    static bool passes(type fragment, type stored) { return fragment >= stored; }
+};
+
+struct DepthUnorm24  // 24 bits of precision in the low bits of 32 bit words, like D24X8
+{
+    using type = std::uint32_t;
+    static type encode(double depth) { return static_cast<type>(depth * (16777215. / 255.) + .5); }
+    static double decode(type value) { return value * (255. / 16777215.); }
+    static bool passes(type fragment, type stored) { return fragment >= stored; }
+};
+
+struct DepthFloat32
+{
+    using type = float;
+    static type encode(double depth) { return static_cast<type>(depth / 255.); }
+    static double decode(type value) { return value * 255.; }
+    static bool passes(type fragment, type stored) { return fragment >= stored; }
+};
+
+struct DepthFloat64  // unquantized
+{
+    using type = double;
+    static type encode(double depth) { return depth; }
+    static double decode(type value) { return value; }
+    static bool passes(type fragment, type stored) { return fragment >= stored; }
+};
+
+// Stores 255 - depth and flips the test: the closest depths get the values near zero, where a
+// float format has most of its precision.
+template <class Format>
+struct ReverseZ
+{
+    using type = typename Format::type;
+    static type encode(double depth) { return Format::encode(255. - depth); }
+    static double decode(type value) { return 255. - Format::decode(value); }
+    static bool passes(type fragment, type stored) { return Format::passes(stored, fragment); }
+};
+
+// Screen space depth of a triangle, the affine function of the pixel coordinates triangle()
+// evaluates for every fragment, clamped to the depth range
+struct DepthPlane
+{
+    double a = 0, b = 0, c = 0;
+    double at(double x, double y) const { return std::max(0., std::min(255., a * x + b * y + c)); }
+    bool operator==(const DepthPlane &p) const { return a == p.a && b == p.b && c == p.c; }
+};
+
+struct DepthTileStats
+{
+    size_t cleared = 0;  // tiles nothing was drawn into since the last clear
+    size_t planes = 0;   // tiles held as depth planes
+    size_t full = 0;     // tiles with per pixel depths
 };
 
+// Depths are stored in 8x8 tiles, tiles in row major order and row major within a tile, so a
+// tile spans a few cache lines whatever the format; triangle() rasterizes in the same order.
+// Each tile only carries a generation and a state byte. clear() only bumps the generation
+// counter: a tile whose generation is behind reads as cleared, and the first store to it resets
+// it.
+// With plane compression, a tile that has been drawn by at most two triangles keeps their depth
+// planes and a per pixel mask instead of per pixel depths, and is given per pixel storage once a
+// third triangle touches it. Planes, masks and that storage are only allocated with compression,
+// the storage as tiles get expanded, and it's recycled by clear(). Depths are recomputed from the
+// planes exactly the way triangle() computed them, so compression never changes a depth test.
+// Tiles fully covered by planes also give a conservative depth bound, which lets triangle()
+// reject whole tiles.
+template <class Format = DepthFloat64>
 struct DepthBuffer
 {
+public:
+    using value_type = typename Format::type;
+    static constexpr size_t tile_size = 8;
+    static constexpr size_t max_planes = 2;
+
+private:
+    static constexpr size_t tile_pixels = tile_size * tile_size;
+    static constexpr std::uint8_t full_tile = 0xff;  // state of a tile with per pixel depths
+    struct TileState
+    {
+        std::uint32_t generation = 0;
+        std::uint8_t state = 0;  // number of planes, or full_tile
+    };
+    struct TilePlanes
+    {
+        std::uint64_t mask[max_planes] = {};  // pixels of the tile that each plane covers
+        DepthPlane planes[max_planes];
+        size_t block = 0;  // per pixel storage of an expanded tile, in tiles
+    };
+    size_t width = 0, height = 0, tiles_x = 0;
+    bool compress = false;
+    std::vector<value_type> data;
+    std::vector<TileState> tiles;
+    std::vector<TilePlanes> planes;  // by tile, with compression only
+    size_t blocks = 0;               // blocks of data handed to expanded tiles
+    std::uint32_t generation = 0;
+    size_t tile(size_t x, size_t y) const { return (y >> 3) * tiles_x + (x >> 3); }
+    static size_t offset(size_t x, size_t y) { return ((y & 7) << 3) + (x & 7); }
+    static std::uint64_t bit(size_t x, size_t y) { return std::uint64_t(1) << offset(x, y); }
+    size_t block(size_t ti) const { return compress ? planes[ti].block : ti; }
+    value_type tile_value(const TilePlanes &t, size_t nplanes, size_t x, size_t y) const
+    {
+        std::uint64_t b = bit(x, y);
+        for (size_t i = 0; i < nplanes; i++) {
+            if (!(t.mask[i] & b)) continue;
+            return Format::encode(t.planes[i].at(static_cast<double>(x), static_cast<double>(y)));
+        }
+        return Format::encode(0.);
+    }
+    void expand(size_t ti)
+    {
+        TileState &t = tiles[ti];
+        if (compress) {
+            planes[ti].block = blocks++;
+            if (data.size() < blocks * tile_pixels) data.resize(blocks * tile_pixels);
+        }
+        size_t x0 = (ti % tiles_x) * tile_size, y0 = (ti / tiles_x) * tile_size;
+        value_type *p = data.data() + block(ti) * tile_pixels;
+        for (size_t y = y0; y < y0 + tile_size; y++)
+            for (size_t x = x0; x < x0 + tile_size; x++)
+                *p++ = compress ? tile_value(planes[ti], t.state, x, y) : Format::encode(0.);
+        t.state = full_tile;
+    }
+
+public:
+    DepthBuffer(size_t width, size_t height, bool plane_compression = false)
+        : width(width),
+          height(height),
+          tiles_x((width + tile_size - 1) / tile_size),
+          compress(plane_compression),
+          tiles(tiles_x * ((height + tile_size - 1) / tile_size))
+    {
+        if (compress)
+            planes.resize(tiles.size());
+        else
+            data.assign(tiles.size() * tile_pixels, Format::encode(0.));
+    }
+    size_t get_width() const { return width; }
+    size_t get_height() const { return height; }
+    // bytes allocated so far; with compression the per pixel storage grows with expanded tiles
+    size_t memory_bytes() const
+    {
+        return data.size() * sizeof(value_type) + tiles.size() * sizeof(TileState) +
+               planes.size() * sizeof(TilePlanes);
+    }
+
+    double get(size_t x, size_t y) const { return Format::decode(load(x, y)); }
+    void set(size_t x, size_t y, double value) { store(x, y, Format::encode(value)); }
+    // encoded access, for the depth test
+    value_type load(size_t x, size_t y) const
+    {
+        size_t ti = tile(x, y);
+        const TileState &t = tiles[ti];
+        if (t.generation != generation) return Format::encode(0.);
+        if (t.state == full_tile) return data[block(ti) * tile_pixels + offset(x, y)];
+        if (!t.state) return Format::encode(0.);
+        return tile_value(planes[ti], t.state, x, y);
+    }
+    // value must be Format::encode(plane->at(x, y)) when a plane is given
+    void store(size_t x, size_t y, value_type value, const DepthPlane *plane = nullptr)
+    {
+        size_t ti = tile(x, y);
+        TileState &t = tiles[ti];
+        if (t.generation != generation) {
+            t.generation = generation;
+            t.state = 0;
+        }
+        if (t.state != full_tile) {
+            if (compress && plane) {
+                TilePlanes &tp = planes[ti];
+                size_t i = 0;
+                while (i < t.state && !(tp.planes[i] == *plane)) i++;
+                if (i < max_planes) {
+                    if (i == t.state) {
+                        tp.planes[t.state++] = *plane;
+                        tp.mask[i] = 0;
+                    }
+                    for (size_t j = 0; j < t.state; j++) tp.mask[j] &= ~bit(x, y);
+                    tp.mask[i] |= bit(x, y);
+                    return;
+                }
+            }
+            expand(ti);
+        }
+        data[block(ti) * tile_pixels + offset(x, y)] = value;
+    }
+    // true when a fragment of the tile holding (x, y) with encoded depth nearest, or any depth
+    // farther than that, fails the depth test at every pixel of the tile
+    bool occludes(size_t x, size_t y, value_type nearest) const
+    {
+        size_t ti = tile(x, y);
+        const TileState &t = tiles[ti];
+        if (t.generation != generation || t.state == full_tile || !t.state) return false;
+        const TilePlanes &tp = planes[ti];
+        std::uint64_t covered = 0;
+        double farthest = 255.;
+        double x0 = static_cast<double>(x & ~size_t(7)), y0 = static_cast<double>(y & ~size_t(7));
+        for (size_t i = 0; i < t.state; i++) {
+            covered |= tp.mask[i];
+            for (double cx : {x0, x0 + 7})
+                for (double cy : {y0, y0 + 7})
+                    farthest = std::min(farthest, tp.planes[i].at(cx, cy));
+        }
+        if (covered != ~std::uint64_t(0)) return false;  // some pixels still hold the clear value
+        return !Format::passes(nearest, Format::encode(farthest));
+    }
+
+    DepthTileStats tile_stats() const
+    {
+        DepthTileStats stats;
+        for (const TileState &t : tiles) {
+            if (t.generation != generation || !t.state)
+                stats.cleared++;
+            else if (t.state == full_tile)
+                stats.full++;
+            else
+                stats.planes++;
+        }
+        return stats;
+    }
+
+    void clear()
+    {
+        blocks = 0;  // every expanded tile is cleared, their storage is free again
+        if (++generation) return;
+        // the counter wrapped around, reset every tile to the current generation
+        std::fill(tiles.begin(), tiles.end(), TileState{});
+    }
+    // the contents tile by tile the way they are held: nothing for a cleared tile, the planes
+    // and masks of a compressed one, the depths of an expanded one; restore() reads them back
+    // into a buffer of the same size, format and compression
+    void save(std::ostream &out) const
+    {
+        for (size_t ti = 0; ti < tiles.size(); ti++) {
+            const TileState &t = tiles[ti];
+            std::uint8_t state = t.generation == generation ? t.state : 0;
+            out.put(static_cast<char>(state));
+            if (state == full_tile) {
+                out.write(reinterpret_cast<const char *>(data.data() + block(ti) * tile_pixels),
+                          static_cast<std::streamsize>(tile_pixels * sizeof(value_type)));
+                continue;
+            }
+            for (size_t i = 0; i < state; i++) {
+                const DepthPlane &plane = planes[ti].planes[i];
+                double abc[3] = {plane.a, plane.b, plane.c};
+                out.write(reinterpret_cast<const char *>(abc), sizeof(abc));
+                out.write(reinterpret_cast<const char *>(&planes[ti].mask[i]),
+                          sizeof(std::uint64_t));
+            }
+        }
+    }
+    bool restore(std::istream &in)
+    {
+        clear();
+        for (size_t ti = 0; ti < tiles.size() && in; ti++) {
+            std::uint8_t state = static_cast<std::uint8_t>(in.get());
+            if (!in || (state > max_planes && state != full_tile) ||
+                (state && state != full_tile && !compress))
+                return false;
+            if (!state) continue;
+            TileState &t = tiles[ti];
+            t.generation = generation;
+            if (state == full_tile) {
+                if (compress) {
+                    planes[ti].block = blocks++;
+                    if (data.size() < blocks * tile_pixels) data.resize(blocks * tile_pixels);
+                }
+                t.state = full_tile;
+                in.read(reinterpret_cast<char *>(data.data() + block(ti) * tile_pixels),
+                        static_cast<std::streamsize>(tile_pixels * sizeof(value_type)));
+                continue;
+            }
+            t.state = state;
+            for (size_t i = 0; i < state; i++) {
+                double abc[3];
+                in.read(reinterpret_cast<char *>(abc), sizeof(abc));
+                planes[ti].planes[i] = {abc[0], abc[1], abc[2]};
+                in.read(reinterpret_cast<char *>(&planes[ti].mask[i]), sizeof(std::uint64_t));
+            }
+        }
+        return static_cast<bool>(in);
+    }
+    void write(const char *filename = "zbuffer.tga") const
+    {
+        TGAImage image(width, height, TGAImage::GRAYSCALE);
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                image.set(x, y, TGAColor(static_cast<uint8_t>(get(x, y))));
+            }
+        }
+        image.write_tga_file(filename);
+    }
+};
+
+enum class ShadingRate
+{
+    Full = 1,
+    Coarse2x2 = 2,
+    Coarse4x4 = 4
+};
+
+struct ShadingRateStats
+{
+    size_t invocations = 0;  // fragment shader runs
+    size_t pixels = 0;       // pixels written, the runs at full rate
+};
+
+// Shading rates of the 8x8 screen tiles triangle() walks. In a tile at 2x2 or 4x4, the fragment
+// shader runs once per block of pixels, at the block center with derivatives that span the
+// block, and its color goes to every pixel of the block that is covered and passes the depth
+// test; coverage and depth stay per pixel. Rates are set for a whole draw with fill(), per tile,
+// or picked by adapt() from a depth pre-pass or an image.
+class ShadingRateMap
+{
+public:
+    static constexpr size_t tile_size = 8;
+    ShadingRateStats stats;
+
+private:
+    size_t tiles_x = 0, tiles_y = 0;
+    std::vector<ShadingRate> rates;
+
+    static ShadingRate classify(double metric, double coarse4, double coarse2)
+    {
+        if (metric < coarse4) return ShadingRate::Coarse4x4;
+        return metric < coarse2 ? ShadingRate::Coarse2x2 : ShadingRate::Full;
+    }
+
+public:
+    ShadingRateMap(size_t width, size_t height, ShadingRate rate = ShadingRate::Full);
+    size_t get_tiles_x() const;
+    size_t get_tiles_y() const;
+    ShadingRate get(size_t x, size_t y) const;  // of the tile holding pixel (x, y)
+    void set_tile(size_t tx, size_t ty, ShadingRate rate);
+    void fill(ShadingRate rate);
+    size_t count(ShadingRate rate) const;  // tiles at rate
+
+    // Smooth surfaces get coarse rates: the metric of a tile is its largest second difference of
+    // depth, which grows with how fast the normal turns. Tiles on a silhouette, where covered
+    // pixels neighbour empty ones, stay at full rate, and empty tiles go to 4x4.
+    template <class Format>
+    void adapt(const DepthBuffer<Format> &zbuffer, double coarse4 = .02, double coarse2 = .1)
+    {
+        size_t width = zbuffer.get_width(), height = zbuffer.get_height();
+        for (size_t ty = 0; ty < tiles_y; ty++)
+            for (size_t tx = 0; tx < tiles_x; tx++) {
+                double metric = 0;
+                for (size_t y = ty * tile_size; y < std::min((ty + 1) * tile_size, height); y++)
+                    for (size_t x = tx * tile_size; x < std::min((tx + 1) * tile_size, width);
+                         x++) {
+                        double z = zbuffer.get(x, y);
+                        if (z <= 0) continue;
+                        double d[2][2] = {{x ? zbuffer.get(x - 1, y) : z,
+                                           x + 1 < width ? zbuffer.get(x + 1, y) : z},
+                                          {y ? zbuffer.get(x, y - 1) : z,
+                                           y + 1 < height ? zbuffer.get(x, y + 1) : z}};
+                        for (auto &n : d) {
+                            if (n[0] <= 0 || n[1] <= 0) metric = coarse2;  // silhouette
+                            metric = std::max(metric, std::abs(n[0] + n[1] - 2 * z));
+                        }
+                    }
+                set_tile(tx, ty, classify(metric, coarse4, coarse2));
+            }
+    }
+    // Content adaptive: the metric of a tile is the largest luminance step between neighbouring
+    // pixels of image, typically the previous frame.
+    void adapt(const TGAImage &image, double coarse4 = 4, double coarse2 = 12);
+};
+
+// scale and measured time of a frame rendered at a dynamic resolution
+struct FrameTime
+{
+    double scale;
+    double ms;
+};
+
+// Dynamic resolution: picks the fraction of the output width and height the next frame renders
+// at, so that frame times approach target_ms. A frame's time is taken as proportional to its
+// pixel count; that estimate of the full resolution time is smoothed over the previous frames,
+// and the scale moves by gain of the way to the one that would meet the target. Time that
+// doesn't scale with the resolution shows up as a higher estimate, which the feedback corrects.
+// The scale is snapped to multiples of scale_step, so a settled controller keeps rendering at the
+// same size and the frame's buffers can be reused.
+class ResolutionController
+{
+private:
+    double target_ms, min_scale, max_scale, scale;
+    double smoothing = .5, gain = .5, scale_step = 1. / 32;
+    double full_ms = 0;  // smoothed estimate of a frame at full resolution
+    std::vector<FrameTime> history_;
+
+public:
+    explicit ResolutionController(double target_ms, double min_scale = .25,
+                                  double max_scale = 1.);
+    double get_scale() const;
+    size_t scaled(size_t size) const;  // size at the current scale, at least 1
+    // ms is the time of the frame rendered at get_scale(), which then applies to the next frame
+    void record(double ms);
+    const std::vector<FrameTime> &history() const;
+};
+
+// Color target with the same deferred clear as DepthBuffer, over the 8x8 tiles of a TGAImage.
+// Tiles nobody drew into are filled with the clear color when the image is resolved.
+class ColorBuffer
+{
 private:
+    static constexpr size_t tile_size = 8;
+    TGAImage img;
+    TGAColor clear_color;
+    size_t tiles_x = 0;
+    std::vector<std::uint32_t> tile_generation;
+    std::uint32_t generation = 0;
+    void fill_tile(size_t t);
+
+public:
+    ColorBuffer(size_t width, size_t height, size_t bytespp);
+    size_t get_width() const;
+    size_t get_height() const;
+    size_t get_bytespp() const;
+    TGAColor get(size_t x, size_t y) const;
+    void set(size_t x, size_t y, const TGAColor &c);
+    void clear(const TGAColor &c = TGAColor());
+    const TGAImage &resolve();  // materializes every cleared tile
+};
+
+enum class TargetFormat
+{
+    R8,         // unsigned normalized, 1 byte
+    RGBA8,      // unsigned normalized, 4 bytes
+    RG16,       // unsigned normalized, 4 bytes
+    RG16Snorm,  // signed normalized, 4 bytes, e.g. octahedral normals
+    R32F        // float, 4 bytes
+};
+
+// Multiple render targets of the same size, each in a format of its own and stored on its own,
+// row major, so a pass reading some of them doesn't fetch the others. Values go in and out as
+// vec4f; components the format doesn't have are dropped on the way in and read back as 0.
+class RenderTargets
+{
+private:
+    struct Target
+    {
+        TargetFormat format;
+        std::vector<std::uint8_t> data;
+    };
     size_t width = 0, height = 0;
-    std::vector<double> data;
+    std::vector<Target> targets;
 
 public:
-    DepthBuffer(size_t width, size_t height);
-    double get(size_t x, size_t y) const;
-    void set(size_t x, size_t y, double value);
-    void write(const char *filename = "zbuffer.tga") const;
+    RenderTargets(size_t width, size_t height, const std::vector<TargetFormat> &formats);
+    static size_t bytespp(TargetFormat format);
+    size_t get_width() const;
+    size_t get_height() const;
+    size_t count() const;
+    TargetFormat format(size_t target) const;
+    size_t memory_bytes() const;
+    vec4f get(size_t target, size_t x, size_t y) const;
+    void get(size_t x, size_t y, FragmentOutputs &out) const;  // every target at once
+    void set(size_t x, size_t y, const FragmentOutputs &out);
+    void clear();  // zeroes every target
 };
 
-void triangle(Model &model, std::array<vec4f, 3> pts, IShader &shader, TGAImage &image,
-              DepthBuffer &zbuffer);
\ No newline at end of file
+// Standard 1, 2, 4 and 8x sample positions, in pixels from the pixel center; empty for any other
+// count
+const std::vector<vec2f> &sample_pattern(size_t samples);
+
+struct MultisampleStats
+{
+    size_t fragments = 0;       // fragment shader runs, one per pixel and triangle
+    size_t shaded_samples = 0;  // samples they were written to, the runs of supersampling
+    size_t depth_tests = 0;     // per sample
+};
+
+// Color and depth per sample for multisample anti-aliasing: triangle() tests coverage and depth
+// at every sample position, runs the fragment shader once per pixel and writes its color to the
+// samples that passed; resolve() averages the samples into an image.
+template <class Format = DepthFloat64>
+class MultisampleBuffer
+{
+public:
+    using value_type = typename Format::type;
+    MultisampleStats stats;
+
+private:
+    size_t width = 0, height = 0, samples = 1;
+    std::vector<vec2f> pattern;
+    std::vector<TGAColor> color;  // the samples of a pixel are next to each other
+    std::vector<value_type> depth;
+
+public:
+    // samples is 1, 2, 4 or 8
+    MultisampleBuffer(size_t width, size_t height, size_t samples)
+        : width(width), height(height), samples(samples), pattern(sample_pattern(samples))
+    {
+        if (pattern.empty()) {
+            std::cerr << "no " << samples << "x sample pattern, using 4x\n";
+            this->samples = 4;
+            pattern = sample_pattern(4);
+        }
+        color.resize(width * height * this->samples);
+        depth.resize(width * height * this->samples, Format::encode(0.));
+    }
+    size_t get_width() const { return width; }
+    size_t get_height() const { return height; }
+    size_t get_samples() const { return samples; }
+    const vec2f &offset(size_t s) const { return pattern[s]; }
+    size_t memory_bytes() const
+    {
+        return color.size() * sizeof(TGAColor) + depth.size() * sizeof(value_type);
+    }
+
+    value_type load(size_t x, size_t y, size_t s) const
+    {
+        return depth[(x + y * width) * samples + s];
+    }
+    void store(size_t x, size_t y, size_t s, value_type value, const TGAColor &c)
+    {
+        size_t i = (x + y * width) * samples + s;
+        depth[i] = value;
+        color[i] = c;
+    }
+
+    void clear(const TGAColor &c = TGAColor())
+    {
+        std::fill(color.begin(), color.end(), c);
+        std::fill(depth.begin(), depth.end(), Format::encode(0.));
+        stats = MultisampleStats();
+    }
+
+    // box filter over the samples of every pixel
+    void resolve(TGAImage &image) const
+    {
+        for (size_t y = 0; y < height; y++)
+            for (size_t x = 0; x < width; x++) {
+                const TGAColor *c = color.data() + (x + y * width) * samples;
+                TGAColor out = c[0];
+                for (size_t k = 0; k < 4; k++) {
+                    size_t sum = 0;
+                    for (size_t s = 0; s < samples; s++) sum += c[s].bgra[k];
+                    out[k] = static_cast<std::uint8_t>((sum + samples / 2) / samples);
+                }
+                image.set(x, y, out);
+            }
+    }
+
+    // keeps the nearest sample of every pixel
+    template <class ZFormat>
+    void resolve_depth(DepthBuffer<ZFormat> &zbuffer) const
+    {
+        zbuffer.clear();
+        for (size_t y = 0; y < height; y++)
+            for (size_t x = 0; x < width; x++) {
+                double nearest = 0;
+                for (size_t s = 0; s < samples; s++)
+                    nearest = std::max(nearest, Format::decode(load(x, y, s)));
+                zbuffer.set(x, y, nearest);
+            }
+    }
+};
+
+// Per pixel face and instance id of a visibility buffer draw, packed in 32 bits: the face in
+// the low 24, the instance in the high 8. Empty pixels hold the reserved value none.
+class VisibilityBuffer
+{
+private:
+    size_t width = 0, height = 0;
+    std::vector<std::uint32_t> ids;
+
+public:
+    static constexpr std::uint32_t none = 0xffffffff;
+    static constexpr std::uint32_t max_faces = 1u << 24;
+    static constexpr std::uint32_t max_instances = (1u << 8) - 1;  // 255 could make none
+    static std::uint32_t pack(size_t face, size_t instance);
+
+    VisibilityBuffer(size_t width, size_t height);
+    size_t get_width() const;
+    size_t get_height() const;
+    std::uint32_t get(size_t x, size_t y) const;
+    void set(size_t x, size_t y, std::uint32_t id);
+    void clear();
+    // the face and instance seen at (x, y), false if there's none
+    bool pick(size_t x, size_t y, size_t &face, size_t &instance) const;
+};
+
+// Color and depth target of one frame
+template <class Format = DepthFloat64>
+struct Framebuffer
+{
+    ColorBuffer color;
+    DepthBuffer<Format> depth;
+    Framebuffer(size_t width, size_t height, size_t bytespp, bool plane_compression = false)
+        : color(width, height, bytespp), depth(width, height, plane_compression)
+    {}
+    void clear(const TGAColor &c = TGAColor())
+    {
+        color.clear(c);
+        depth.clear();
+    }
+};
+
+// Keeps released framebuffers so that rendering a sequence of frames reuses their allocations;
+// acquire() hands out a cleared framebuffer of the requested size.
+template <class Format = DepthFloat64>
+class FramebufferPool
+{
+private:
+    std::vector<std::unique_ptr<Framebuffer<Format>>> released;
+    size_t allocations = 0, reuses = 0;
+    bool plane_compression;  // of the depth buffers the pool allocates
+
+public:
+    explicit FramebufferPool(bool plane_compression = false) : plane_compression(plane_compression)
+    {}
+    std::unique_ptr<Framebuffer<Format>> acquire(size_t width, size_t height, size_t bytespp,
+                                                 const TGAColor &c = TGAColor())
+    {
+        for (auto it = released.begin(); it != released.end(); ++it) {
+            const ColorBuffer &color = (*it)->color;
+            if (color.get_width() != width || color.get_height() != height ||
+                color.get_bytespp() != bytespp)
+                continue;
+            std::unique_ptr<Framebuffer<Format>> fb = std::move(*it);
+            released.erase(it);
+            fb->clear(c);
+            reuses++;
+            return fb;
+        }
+        allocations++;
+        auto fb =
+            std::make_unique<Framebuffer<Format>>(width, height, bytespp, plane_compression);
+        fb->clear(c);
+        return fb;
+    }
+    void release(std::unique_ptr<Framebuffer<Format>> fb) { released.push_back(std::move(fb)); }
+    size_t get_allocations() const { return allocations; }
+    size_t get_reuses() const { return reuses; }
+};
+
+DepthPlane depth_plane(const std::array<vec4f, 3> &pts);  // pts as for triangle()
+
+// instantiated for every depth format above, plain and reversed, drawing into a TGAImage, a
+// ColorBuffer or RenderTargets
+template <class Format, class Target>
+void triangle(Model &model, std::array<vec4f, 3> pts, IShader &shader, Target &image,
+              DepthBuffer<Format> &zbuffer);
+
+// Multisampled draw, depth is in the target. The shader runs at the pixel center, or at the
+// first covered sample when the center is outside of the triangle, so attributes are never
+// extrapolated. Instantiated for the same depth formats as triangle().
+template <class Format>
+void triangle(Model &model, std::array<vec4f, 3> pts, IShader &shader,
+              MultisampleBuffer<Format> &target);
+
+// one view of a multiview_draw(): its shader carries the ModelView, Projection and Viewport of
+// the view, and draws into its own color and depth targets
+template <class Format>
+struct ViewTarget
+{
+    IShader *shader;
+    TGAImage *image;
+    DepthBuffer<Format> *zbuffer;
+};
+
+// Draws model into every view at once: the attributes of every triangle corner are fetched
+// once, then each view runs its vertex shader on them through vertex_fetched() and rasterizes
+// into its own targets, the views spread over nthreads threads (0 for one per core). The images
+// are the same as drawing every view on its own. Instantiated for the depth formats of
+// triangle().
+template <class Format>
+void multiview_draw(Model &model, const std::vector<ViewTarget<Format>> &views,
+                    size_t nthreads = 0);
+
+// Depth only draw: fetches nothing but the vertex positions, transforms them by transform (to
+// the same screen coordinates a vertex shader returns) and writes depth, without a fragment
+// shader or color target. Instantiated for the same depth formats as triangle().
+template <class Format>
+void depth_pass(Model &model, const mat4 &transform, DepthBuffer<Format> &zbuffer);
+// Point or spot light of the tiled light lists, in world space
+struct Light
+{
+    vec3f position;
+    vec3f color = vec3f(1, 1, 1);      // intensity per channel, red first
+    double radius = 1;                 // no effect from this distance on
+    vec3f direction = vec3f(0, 0, -1);  // spot lights: axis of the cone, unit length
+    double cos_cutoff = -1;            // spot lights: cosine of the cone half angle, -1 for points
+    // fraction of the intensity reaching p: a smooth window over the radius, and the cone
+    double attenuation(const vec3f &p) const;
+};
+
+struct LightGridStats
+{
+    size_t tiles = 0;
+    size_t covered_tiles = 0;          // tiles with geometry
+    double average_lights = 0;         // per covered tile
+    size_t max_lights = 0;             // in any tile
+    size_t evaluations = 0;            // light evaluations over the covered pixels, tiled
+    size_t brute_force_evaluations = 0;  // the same, looping over every light
+};
+
+// Forward+ light lists: after a depth pre-pass, every screen tile with geometry gets the lights
+// whose sphere of influence touches the part of the view frustum between the tile's nearest and
+// farthest depth. Shading then loops over the lights of its tile only.
+class LightGrid
+{
+private:
+    size_t tile_size = 16, tiles_x = 0, tiles_y = 0;
+    // the lights of tile t are indices[offsets[t]] up to indices[offsets[t + 1]]
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> indices;
+    LightGridStats stats_;
+
+    // conservative world space box of the frustum part above the screen rectangle between depths
+    // zmin and zmax, screen_inverse being the inverse of the world to screen transform
+    static void tile_bounds(const mat4 &screen_inverse, double x0, double y0, double x1, double y1,
+                            double zmin, double zmax, vec3f &lo, vec3f &hi);
+    void bin(const std::vector<Light> &lights, const mat4 &screen_inverse,
+             const std::vector<double> &zmin, const std::vector<double> &zmax,
+             const std::vector<size_t> &covered);
+
+public:
+    explicit LightGrid(size_t tile_size = 16) : tile_size(tile_size) {}
+
+    // screen is the world to screen transform the depth buffer was drawn with
+    template <class Format>
+    void build(const std::vector<Light> &lights, const DepthBuffer<Format> &zbuffer,
+               const mat4 &screen)
+    {
+        tiles_x = (zbuffer.get_width() + tile_size - 1) / tile_size;
+        tiles_y = (zbuffer.get_height() + tile_size - 1) / tile_size;
+        std::vector<double> zmin(tiles_x * tiles_y, 255.), zmax(tiles_x * tiles_y, 0.);
+        std::vector<size_t> covered(tiles_x * tiles_y, 0);
+        for (size_t y = 0; y < zbuffer.get_height(); y++)
+            for (size_t x = 0; x < zbuffer.get_width(); x++) {
+                double z = zbuffer.get(x, y);
+                if (z <= 0) continue;  // cleared, nothing to light
+                size_t t = y / tile_size * tiles_x + x / tile_size;
+                zmin[t] = std::min(zmin[t], z - .5);  // undo the depth_plane() rounding
+                zmax[t] = std::max(zmax[t], z - .5);
+                covered[t]++;
+            }
+        bin(lights, screen.invert(), zmin, zmax, covered);
+    }
+
+    // indices of the lights that can reach the pixel (x, y)
+    std::pair<const std::uint32_t *, const std::uint32_t *> lights(size_t x, size_t y) const;
+    LightGridStats stats() const;
+};
+
+// First half of visibility buffer rendering: rasterizes the faces of model, as the vertex
+// shader places them, writing nothing but depth and the packed face and instance id. The
+// fragment shader doesn't run; it's up to resolve_visibility() to run it once per pixel.
+template <class Format>
+void visibility_pass(Model &model, size_t instance, IShader &shader, VisibilityBuffer &vis,
+                     DepthBuffer<Format> &zbuffer);
+
+// what an instance id of a visibility buffer stands for
+struct VisibilityInstance
+{
+    Model *model;
+    IShader *shader;
+};
+
+// Second half of visibility buffer rendering: for every covered pixel, reruns the vertex shader
+// of its face, computes the barycentric coordinates and their derivatives there and runs the
+// fragment shader. Consecutive pixels of the same face share the vertex shader work.
+template <class Target>
+void resolve_visibility(const VisibilityBuffer &vis,
+                        const std::vector<VisibilityInstance> &instances, Target &image);
+
+struct ProgressivePass
+{
+    size_t index;     // from 0
+    size_t passes;    // in the frame
+    size_t spacing;   // between the pixels resolved by this pass, in x and y
+    size_t resolved;  // pixels resolved so far, by this pass and the previous ones
+};
+using ProgressCallback = std::function<void(const TGAImage &, const ProgressivePass &)>;
+
+// resolve_visibility() in interleaved passes, for a usable image long before the frame is done.
+// The first pass shades every step-th pixel in x and y (step a power of two) and copies each
+// color over the step x step block the pixel starts; every following pass halves the spacing,
+// shades the pixels of the finer lattice the previous passes skipped and fills their smaller
+// blocks. The last pass, at spacing 1, leaves the same image resolve_visibility() draws into a
+// cleared one. progress gets the image after every pass.
+void resolve_visibility_progressive(const VisibilityBuffer &vis,
+                                    const std::vector<VisibilityInstance> &instances,
+                                    TGAImage &image, size_t step, const ProgressCallback &progress);
+
+struct ReprojectionStats
+{
+    size_t pixels = 0;       // covered by the frame
+    size_t reused = 0;       // colors taken from the previous frame
+    size_t disoccluded = 0;  // reprojected out of the previous frame or onto another surface
+    size_t rejected = 0;     // same surface, but its depth didn't match
+    size_t stale = 0;        // reused for max_age frames in a row
+    size_t drifted = 0;      // would land farther than max_offset from where it was shaded
+    double reuse_ratio = 0;  // reused / pixels
+    // with validate, how far the reused colors are from shading them anew, per channel
+    int max_error = 0;
+    double mean_error = 0;
+};
+
+// Temporal reuse of shading across the frames of a camera path over the same scene. Keeps the
+// color, depth and face ids of the previous frame; resolve() unprojects every covered pixel of
+// a new visibility buffer to world space, projects it into the previous frame's screen, and
+// takes the color of the nearest pixel there if it saw the same face at the same depth, within
+// depth_tolerance. Each reuse moves a color by up to half a pixel from where it was shaded,
+// which adds up over frames, so the offset is tracked per pixel and kept under max_offset
+// pixels; max_age bounds the drift of view dependent shading. Pixels that fail any of these
+// are shaded. validate also shades the reused pixels, to measure the error instead of saving
+// the work.
+class ReprojectionCache
+{
+private:
+    size_t width = 0, height = 0;
+    TGAImage color;
+    VisibilityBuffer ids;
+    std::vector<float> depth;        // screen depth as the vertex shader computed it
+    std::vector<std::uint8_t> ages;  // frames the color has been reused
+    std::vector<vec2f> offsets;      // from the pixel to where its color was shaded
+    mat4 screen = mat4::identity();  // world to screen transform of the previous frame
+    bool valid = false;
+
+public:
+    double depth_tolerance = 1.;  // in the [0, 255] screen depth units
+    double max_offset = .75;       // in pixels
+    size_t max_age = 8;
+    bool validate = false;
+
+    ReprojectionCache(size_t width, size_t height);
+    void clear();  // the next frame is shaded from scratch
+
+    // resolves vis into image like resolve_visibility(); zbuffer and transform, from world to
+    // screen coordinates, are what vis was drawn with. Instantiated for the depth formats of
+    // triangle().
+    template <class Format>
+    ReprojectionStats resolve(const VisibilityBuffer &vis, const DepthBuffer<Format> &zbuffer,
+                              const mat4 &transform,
+                              const std::vector<VisibilityInstance> &instances, TGAImage &image);
+};
+
+// Second half of deferred shading: runs once per pixel on what a geometry pass left in the
+// render targets, so its cost depends on the resolution only, not on overdraw. p is the screen
+// position of the pixel and its depth as the vertex shader computed it.
+struct ILightingShader
+{
+    virtual ~ILightingShader();
+    virtual bool fragment(const FragmentOutputs &in, vec3f p, TGAColor &color) = 0;
+};
+
+// nthreads other than 1 splits the rows across threads, 0 for one per core, in bands of 8 rows
+// so that no ColorBuffer tile is written by two; shader.fragment() must then be safe to call
+// concurrently
+template <class Format, class Target>
+void lighting_pass(const RenderTargets &targets, const DepthBuffer<Format> &zbuffer,
+                   ILightingShader &shader, Target &image, size_t nthreads = 1)
+{
+    const size_t band = 8;
+    size_t height = targets.get_height();
+    parallel_for(
+        0, (height + band - 1) / band,
+        [&](size_t begin, size_t end) {
+            FragmentOutputs in;
+            TGAColor color;
+            for (size_t y = begin * band; y < std::min(end * band, height); y++) {
+                for (size_t x = 0; x < targets.get_width(); x++) {
+                    targets.get(x, y, in);
+                    // undo the rounding offset depth_plane() adds
+                    vec3f p(static_cast<double>(x), static_cast<double>(y),
+                            zbuffer.get(x, y) - .5);
+                    if (!shader.fragment(in, p, color)) image.set(x, y, color);
+                }
+            }
+        },
+        nthreads);
+}
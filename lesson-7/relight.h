@@ -0,0 +1,65 @@
+#pragma once
+#include <memory>
+
+#include "our_gl.h"
+#include "shaders.h"
+#include "shadow_map.h"
+
+// Relighting of a fixed view: the model is rasterized once into a surface cache, the G-buffer
+// of the deferred path and its depth, which holds the outcome of every texture lookup (normal,
+// diffuse color, specular exponent), so the uvs aren't needed anymore. relight() then only runs
+// the lighting of DeferredShader over it, across threads. Shadow maps come from ShadowMapCache,
+// so one is only rendered for a light direction it hasn't seen yet.
+template <class ShadowFormat = DepthUnorm16>
+class Relighter
+{
+private:
+    Model &model;
+    mat4 ModelView;
+    mat4 Screen;  // world to screen coordinates of the cached view
+    size_t shadow_size;
+    vec3f up;
+    RenderTargets gbuffer;
+    DepthBuffer<ReverseZ<DepthFloat32>> zbuffer;
+
+public:
+    Relighter(Model &model, const mat4 &ModelView, const mat4 &Projection, const mat4 &Viewport,
+              size_t width, size_t height, size_t shadow_size = 1024,
+              vec3f up = vec3f(0, 1, 0))
+        : model(model),
+          ModelView(ModelView),
+          Screen(Viewport * Projection * ModelView),
+          shadow_size(shadow_size),
+          up(up),
+          gbuffer(width, height, gbuffer_formats),
+          zbuffer(width, height, true)
+    {
+        GBufferShader geometry{(Projection * ModelView).invert_transpose()};
+        geometry.uniform_ModelView = ModelView;
+        geometry.uniform_Viewport = Viewport;
+        geometry.uniform_Projection = Projection;
+        std::array<vec4f, 3> screen_coords;
+        for (size_t i = 0; i < model.nfaces(); i++) {
+            for (size_t j = 0; j < 3; j++)
+                screen_coords[j] =
+                    geometry.vertex(model, static_cast<int>(i), static_cast<int>(j));
+            triangle(model, screen_coords, geometry, gbuffer, zbuffer);
+        }
+    }
+
+    // lights the cached surfaces from light_dir, pointing towards the light, into image;
+    // nthreads as for lighting_pass()
+    void relight(vec3f light_dir, TGAImage &image, size_t nthreads = 0) const
+    {
+        light_dir = light_dir.normalize();
+        std::shared_ptr<const ShadowMap<ShadowFormat>> shadow =
+            ShadowMapCache<ShadowFormat>::instance().get(model, light_dir, up, shadow_size,
+                                                         shadow_size);
+        DeferredShader<ShadowFormat> lighting{ModelView, shadow->transform() * Screen.invert(),
+                                              light_dir, *shadow};
+        lighting_pass(gbuffer, zbuffer, lighting, image, nthreads);
+    }
+
+    const RenderTargets &surfaces() const { return gbuffer; }
+    const DepthBuffer<ReverseZ<DepthFloat32>> &depth() const { return zbuffer; }
+};
@@ -0,0 +1,201 @@
+#pragma once
+#include "our_gl.h"
+#include "shadow_map.h"
+
+// The lighting of both paths: phong with a shadow term, n and l unit vectors in the same space,
+// c the diffuse color and specular the exponent
+inline void phong(TGAColor c, double specular, double shadow, const vec3f& n,
+                  const vec3f& l, TGAColor& color)
+{
+    vec3f r = (n * (dot(n, l) * 2.) - l).normalize();  // reflected light
+    double spec = std::pow(std::max(r.z, 0.0), specular);
+    double diff = std::max(0., dot(n, l));
+    for (size_t i = 0; i < 3; i++)
+        color[i] =
+            static_cast<uint8_t>(std::min(20 + c[i] * shadow * (1.2 * diff + .6 * spec), 255.));
+}
+
+template <class ShadowFormat>
+struct Shader : public IShader
+{
+    mat<4, 4> uniform_M;        // ModelView, brings the light direction to eye space
+    mat<4, 4> uniform_MIT;      // (Projection*ModelView).invert_transpose()
+    mat<4, 4> uniform_Mshadow;  // transform framebuffer screen coordinates to shadowbuffer screen
+                                // coordinates
+    mat<2, 3> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the
+                           // fragment shader
+    mat<3, 3>
+        varying_tri;  // triangle coordinates before Viewport transform, written by VS, read by FS
+    const ShadowMap<ShadowFormat>& shadow_map;
+    vec3f uniform_light_dir;
+    // point and spot lights on top of the directional one, shaded only where light_grid lists
+    // them; none without a grid
+    const std::vector<Light>* uniform_lights = nullptr;
+    const LightGrid* light_grid = nullptr;
+    vec3f uniform_eye;             // world space, for the specular term of the local lights
+    mat<4, 4> uniform_Screen_inv;  // framebuffer screen coordinates to world space
+
+    Shader(mat4 M, mat4 MIT, mat4 MS, const ShadowMap<ShadowFormat>& shadow_map)
+        : uniform_M(M),
+          uniform_MIT(MIT),
+          uniform_Mshadow(MS),
+          varying_uv(),
+          varying_tri(),
+          shadow_map(shadow_map)
+    {}
+
+    virtual vec4f vertex(Model& model, int iface, int nthvert)
+    {
+        size_t i = static_cast<size_t>(iface), j = static_cast<size_t>(nthvert);
+        return vertex_fetched({model.vert(i, j), model.uv(i, j)}, nthvert);
+    }
+
+    virtual vec4f vertex_fetched(const VertexAttributes& in, int nthvert)
+    {
+        varying_uv.set_col(static_cast<size_t>(nthvert), in.uv);
+        vec4f gl_Vertex =
+            uniform_Viewport * uniform_Projection * uniform_ModelView * embed<4>(in.position);
+        varying_tri.set_col(static_cast<size_t>(nthvert), proj<3>(gl_Vertex / gl_Vertex[3]));
+        return gl_Vertex;
+    }
+
+    // adds the lights of the pixel's tile, n the world space normal
+    void local_lights(const vec3f& n, const vec3f& screen, TGAColor c, double specular,
+                      TGAColor& color) const
+    {
+        // the surface point, unprojected the way LightGrid bounds its tiles
+        vec4f pw = uniform_Screen_inv * embed<4>(screen);
+        vec3f p = proj<3>(pw / pw[3]);
+        // screen is interpolated, so the pixel coordinates are only nearly integers
+        auto range = light_grid->lights(static_cast<size_t>(std::max(screen.x + .5, 0.)),
+                                        static_cast<size_t>(std::max(screen.y + .5, 0.)));
+        vec3f v = (uniform_eye - p).normalize();
+        vec3f sum(0, 0, 0);
+        for (const std::uint32_t* i = range.first; i != range.second; ++i) {
+            const Light& light = (*uniform_lights)[*i];
+            double a = light.attenuation(p);
+            if (a <= 0) continue;
+            vec3f l = (light.position - p).normalize();
+            vec3f r = (n * (dot(n, l) * 2.) - l).normalize();
+            double diff = std::max(0., dot(n, l));
+            double spec = std::pow(std::max(dot(r, v), 0.), specular);
+            sum = sum + light.color * (a * (diff + .6 * spec));
+        }
+        for (size_t i = 0; i < 3; i++)  // TGAColor is blue first
+            color[i] = static_cast<uint8_t>(std::min(color[i] + c[i] * sum[2 - i], 255.));
+    }
+
+    virtual bool fragment(Model& model, vec3f bar, TGAColor& color)
+    {
+        vec4f sb_p = uniform_Mshadow *
+                     embed<4>(varying_tri * bar);  // corresponding point in the shadow buffer
+        sb_p = sb_p / sb_p[3];
+        double shadow =
+            .3 + .7 * shadow_map.lit(proj<3>(sb_p), .34);  // magic coeff to avoid z-fighting
+        vec2f uv = varying_uv * bar;  // interpolate uv for the current pixel
+        vec2f duvdx = varying_uv * bar_dx;  // uv footprint of the pixel, selects the mip level
+        vec2f duvdy = varying_uv * bar_dy;
+        vec3f nw = model.normal(uv, duvdx, duvdy).normalize();              // world space normal
+        vec3f n = proj<3>(uniform_MIT * embed<4>(nw)).normalize();          // normal
+        vec3f l = proj<3>(uniform_M * embed<4>(uniform_light_dir)).normalize();  // light vector
+        TGAColor c = model.diffuse(uv, duvdx, duvdy);
+        double specular = model.specular(uv, duvdx, duvdy);
+        phong(c, specular, shadow, n, l, color);
+        if (light_grid) local_lights(nw, varying_tri * bar, c, specular, color);
+        return false;
+    }
+};
+
+// Shader of a camera, set up the way lesson-7 renders: uniform_M is the ModelView, the shadow
+// lookups go from the camera's screen coordinates to shadow_map's, and the camera transforms are
+// placed, so the shader is ready to draw
+template <class ShadowFormat>
+Shader<ShadowFormat> camera_shader(const mat4& ModelView, const mat4& Projection,
+                                   const mat4& Viewport, vec3f light_dir,
+                                   const ShadowMap<ShadowFormat>& shadow_map)
+{
+    mat4 Screen = Viewport * Projection * ModelView;
+    Shader<ShadowFormat> shader{ModelView, (Projection * ModelView).invert_transpose(),
+                                shadow_map.transform() * Screen.invert(), shadow_map};
+    shader.uniform_ModelView = ModelView;
+    shader.uniform_Viewport = Viewport;
+    shader.uniform_Projection = Projection;
+    shader.uniform_light_dir = light_dir;
+    return shader;
+}
+
+// G-buffer of the deferred path, in the order of the render targets
+enum GBufferTarget
+{
+    gbuffer_normal,    // RG16Snorm, octahedral encoded normal
+    gbuffer_albedo,    // RGBA8, diffuse color with coverage in alpha
+    gbuffer_specular,  // R8, specular exponent / 255
+};
+const std::vector<TargetFormat> gbuffer_formats = {TargetFormat::RG16Snorm, TargetFormat::RGBA8,
+                                                   TargetFormat::R8};
+
+// Geometry pass of the deferred path: the texture lookups of Shader, without any lighting
+struct GBufferShader : public IShader
+{
+    mat<4, 4> uniform_MIT;  // (Projection*ModelView).invert_transpose()
+    mat<2, 3> varying_uv;   // triangle uv coordinates, written by the vertex shader, read by the
+                            // fragment shader
+
+    GBufferShader(mat4 MIT) : uniform_MIT(MIT), varying_uv() {}
+
+    virtual vec4f vertex(Model& model, int iface, int nthvert)
+    {
+        size_t i = static_cast<size_t>(iface), j = static_cast<size_t>(nthvert);
+        return vertex_fetched({model.vert(i, j), model.uv(i, j)}, nthvert);
+    }
+
+    virtual vec4f vertex_fetched(const VertexAttributes& in, int nthvert)
+    {
+        varying_uv.set_col(static_cast<size_t>(nthvert), in.uv);
+        return uniform_Viewport * uniform_Projection * uniform_ModelView * embed<4>(in.position);
+    }
+
+    virtual bool fragment_targets(Model& model, vec3f bar, FragmentOutputs& out)
+    {
+        vec2f uv = varying_uv * bar;
+        vec2f duvdx = varying_uv * bar_dx;
+        vec2f duvdy = varying_uv * bar_dy;
+        vec3f n = proj<3>(uniform_MIT * embed<4>(model.normal(uv, duvdx, duvdy).normalize()))
+                      .normalize();
+        vec2f packed = octahedral_encode(n);
+        TGAColor c = model.diffuse(uv, duvdx, duvdy);
+        out[gbuffer_normal] = embed<4>(packed, 0);
+        out[gbuffer_albedo] = embed<4>(vec3f(c[0], c[1], c[2]) / 255.);
+        out[gbuffer_specular] = embed<4>(vec3f(model.specular(uv, duvdx, duvdy) / 255., 0, 0), 0);
+        return false;
+    }
+};
+
+// Lighting pass of the deferred path, the shading of Shader from the G-buffer
+template <class ShadowFormat>
+struct DeferredShader : public ILightingShader
+{
+    mat<4, 4> uniform_Mshadow;  // framebuffer screen coordinates to shadow map screen coordinates
+    vec3f uniform_l;            // light vector, in the space of the G-buffer normals
+    const ShadowMap<ShadowFormat>& shadow_map;
+
+    DeferredShader(mat4 M, mat4 MS, vec3f light_dir, const ShadowMap<ShadowFormat>& shadow_map)
+        : uniform_Mshadow(MS),
+          uniform_l(proj<3>(M * embed<4>(light_dir)).normalize()),
+          shadow_map(shadow_map)
+    {}
+
+    virtual bool fragment(const FragmentOutputs& in, vec3f p, TGAColor& color)
+    {
+        if (in[gbuffer_albedo][3] == 0) return true;  // no geometry here
+        vec4f sb_p = uniform_Mshadow * embed<4>(p);
+        sb_p = sb_p / sb_p[3];
+        double shadow = .3 + .7 * shadow_map.lit(proj<3>(sb_p), .34);
+        vec3f n = octahedral_decode(in[gbuffer_normal][0], in[gbuffer_normal][1]);
+        TGAColor c;
+        for (size_t i = 0; i < 3; i++)
+            c[i] = static_cast<uint8_t>(std::lround(in[gbuffer_albedo][i] * 255.));
+        phong(c, in[gbuffer_specular][0] * 255., shadow, n, uniform_l, color);
+        return false;
+    }
+};
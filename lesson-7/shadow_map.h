@@ -0,0 +1,309 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include "our_gl.h"
+
+// Depth map seen from a directional light, with a resolution of its own. fit() places an
+// orthographic light frustum tightly around the model: its bounds in light space span the whole
+// map, with a one texel border, and the whole depth range. Lookups are clamped to the map.
+template <class Format = DepthUnorm16>
+class ShadowMap
+{
+private:
+    DepthBuffer<Format> depth;
+    mat4 transform_ = mat4::identity();  // world to shadow map screen coordinates
+    double depth_scale = 1.;             // depth units per world unit along the light
+
+public:
+    ShadowMap(size_t width, size_t height, bool plane_compression = true)
+        : depth(width, height, plane_compression)
+    {}
+
+    // world to screen transform of the orthographic light frustum fitted around model, for a
+    // width x height map
+    static mat4 fitted_transform(const Model &model, vec3f light_dir, vec3f up, size_t width,
+                                 size_t height)
+    {
+        light_dir.normalize();
+        if (cross(up, light_dir).norm() < 1e-6) up = vec3f(1, 0, 0);
+        mat4 light_view = lookat(light_dir, vec3f(0, 0, 0), up);
+        vec3f lo(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+                 std::numeric_limits<double>::max());
+        vec3f hi = lo * -1.;
+        for (size_t i = 0; i < model.nverts(); i++) {
+            vec3f v = proj<3>(light_view * embed<4>(model.vert(i)));
+            for (size_t k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], v[k]);
+                hi[k] = std::max(hi[k], v[k]);
+            }
+        }
+        if (!model.nverts()) lo = hi = vec3f(0, 0, 0);
+        double size[3] = {static_cast<double>(width), static_cast<double>(height), 255.};
+        double border[3] = {1., 1., 0.};
+        mat4 ortho = mat4::identity();
+        for (size_t k = 0; k < 3; k++) {
+            double scale = (size[k] - 2 * border[k]) / std::max(hi[k] - lo[k], 1e-9);
+            ortho[k][k] = scale;
+            ortho[k][3] = border[k] - lo[k] * scale;
+        }
+        return ortho * light_view;
+    }
+
+    void fit(const Model &model, vec3f light_dir, vec3f up = vec3f(0, 1, 0))
+    {
+        set_transform(
+            fitted_transform(model, light_dir, up, depth.get_width(), depth.get_height()));
+    }
+
+    void set_transform(const mat4 &transform)
+    {
+        transform_ = transform;
+        // the light view is a rotation, so the depth row keeps the frustum's depth scale
+        depth_scale = vec3f(transform[2][0], transform[2][1], transform[2][2]).norm();
+    }
+
+    void render(Model &model)
+    {
+        depth.clear();
+        depth_pass(model, transform_, depth);
+    }
+
+    const mat4 &transform() const { return transform_; }
+    const DepthBuffer<Format> &buffer() const { return depth; }
+    DepthBuffer<Format> &buffer() { return depth; }
+
+    // stored depth at shadow map screen coordinates (x, y), clamped to the edge texels
+    double get(double x, double y) const
+    {
+        double maxx = static_cast<double>(depth.get_width() - 1);
+        double maxy = static_cast<double>(depth.get_height() - 1);
+        return depth.get(static_cast<size_t>(std::max(0., std::min(x, maxx))),
+                         static_cast<size_t>(std::max(0., std::min(y, maxy))));
+    }
+
+    // whether the point p, in shadow map screen coordinates, is the closest to the light; bias is
+    // in world units, so it doesn't depend on the depth range the frustum was fitted to
+    bool lit(const vec3f &p, double bias) const
+    {
+        return get(p.x, p.y) <= p.z + bias * depth_scale;
+    }
+};
+
+struct ShadowCacheStats
+{
+    size_t hits = 0;       // served from memory
+    size_t disk_hits = 0;  // read back from the cache directory
+    size_t misses = 0;     // rendered
+    size_t disk_writes = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t resident_bytes = 0;  // depth buffer memory of the maps kept in memory
+    size_t budget_bytes = 0;
+};
+
+// Process wide cache of rendered shadow maps, for renders where the light and the model stay
+// put while the camera moves. A map is keyed by a hash of its fitted light transform, the model
+// geometry, its resolution and depth format, so any change to these renders a new one. With a
+// cache directory set, maps are also written there and read back by later runs. Once the maps
+// in memory go over the budget, the least recently used ones nobody holds any more are dropped,
+// as TextureCache does.
+template <class Format = DepthUnorm16>
+class ShadowMapCache
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<const ShadowMap<Format>> map;
+        size_t bytes = 0;
+        std::uint64_t last_use = 0;
+    };
+    mutable std::mutex mutex_;
+    std::map<std::uint64_t, Entry> entries_;
+    std::uint64_t clock_ = 0;
+    std::string directory_;
+    ShadowCacheStats stats_;
+
+    static constexpr size_t default_budget = size_t(64) << 20;
+
+    static constexpr std::uint64_t magic = 0x32504d5744414853;  // "SHADWMP2"
+
+    // 64 bit FNV-1a
+    static void hash(std::uint64_t &h, const void *data, size_t bytes)
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < bytes; i++) h = (h ^ p[i]) * 0x100000001b3;
+    }
+
+    static std::uint64_t key(const Model &model, const mat4 &transform, size_t width,
+                             size_t height)
+    {
+        std::uint64_t h = 0xcbf29ce484222325;
+        for (size_t i = 0; i < 4; i++)
+            for (size_t j = 0; j < 4; j++) {
+                double v = transform[i][j];
+                hash(h, &v, sizeof(v));
+            }
+        for (size_t i = 0; i < model.nfaces(); i++)
+            for (size_t j = 0; j < 3; j++) {
+                vec3f v = model.vert(i, j);
+                for (size_t k = 0; k < 3; k++) hash(h, &v[k], sizeof(double));
+            }
+        hash(h, &width, sizeof(width));
+        hash(h, &height, sizeof(height));
+        std::string format = typeid(Format).name();
+        hash(h, format.data(), format.size());
+        return h;
+    }
+
+    static std::string path(const std::string &directory, std::uint64_t key)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "shadow_%016llx.bin",
+                      static_cast<unsigned long long>(key));
+        return directory + "/" + name;
+    }
+
+    // the depth buffer is stored the way it is held, so a map read back keeps the compressed
+    // tiles of a rendered one
+    static std::shared_ptr<ShadowMap<Format>> read(const std::string &directory,
+                                                   std::uint64_t key, const mat4 &transform,
+                                                   size_t width, size_t height)
+    {
+        std::ifstream in(path(directory, key), std::ios::binary);
+        if (!in) return nullptr;
+        std::uint64_t header[2];
+        in.read(reinterpret_cast<char *>(header), sizeof(header));
+        if (!in || header[0] != magic || header[1] != key) return nullptr;
+        auto map = std::make_shared<ShadowMap<Format>>(width, height);
+        map->set_transform(transform);
+        if (!map->buffer().restore(in)) {
+            std::cerr << "can't read shadow map " << path(directory, key) << "\n";
+            return nullptr;
+        }
+        return map;
+    }
+
+    static bool write(const std::string &directory, std::uint64_t key,
+                      const ShadowMap<Format> &map)
+    {
+        std::ofstream out(path(directory, key), std::ios::binary);
+        std::uint64_t header[2] = {magic, key};
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        map.buffer().save(out);
+        if (!out) std::cerr << "can't write shadow map " << path(directory, key) << "\n";
+        return static_cast<bool>(out);
+    }
+
+    ShadowMapCache() { stats_.budget_bytes = default_budget; }
+
+    void evict_locked()
+    {
+        while (stats_.resident_bytes > stats_.budget_bytes) {
+            auto victim = entries_.end();
+            for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+                if (it->second.map.use_count() > 1) continue;  // still held by a renderer
+                if (victim == entries_.end() || it->second.last_use < victim->second.last_use)
+                    victim = it;
+            }
+            if (victim == entries_.end()) return;
+            stats_.resident_bytes -= victim->second.bytes;
+            stats_.evictions++;
+            entries_.erase(victim);
+        }
+    }
+
+public:
+    static ShadowMapCache &instance()
+    {
+        static ShadowMapCache cache;
+        return cache;
+    }
+
+    // the shadow map of model lit along light_dir, rendered only if no cached one matches
+    std::shared_ptr<const ShadowMap<Format>> get(Model &model, vec3f light_dir, vec3f up,
+                                                 size_t width, size_t height)
+    {
+        mat4 transform =
+            ShadowMap<Format>::fitted_transform(model, light_dir, up, width, height);
+        std::uint64_t k = key(model, transform, width, height);
+        std::string directory;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(k);
+            if (it != entries_.end()) {
+                stats_.hits++;
+                it->second.last_use = ++clock_;
+                return it->second.map;
+            }
+            directory = directory_;
+        }
+
+        // read or render without holding the lock
+        std::shared_ptr<ShadowMap<Format>> map;
+        if (!directory.empty()) map = read(directory, k, transform, width, height);
+        bool rendered = !map;
+        if (rendered) {
+            map = std::make_shared<ShadowMap<Format>>(width, height);
+            map->set_transform(transform);
+            map->render(model);
+        }
+        bool written = rendered && !directory.empty() && write(directory, k, *map);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        (rendered ? stats_.misses : stats_.disk_hits)++;
+        stats_.disk_writes += written;
+        Entry &entry = entries_[k];
+        if (!entry.map) {  // another thread may have rendered the same map meanwhile
+            entry.map = map;
+            entry.bytes = map->buffer().memory_bytes();
+            stats_.resident_bytes += entry.bytes;
+        }
+        entry.last_use = ++clock_;
+        std::shared_ptr<const ShadowMap<Format>> ret = entry.map;
+        evict_locked();
+        return ret;
+    }
+
+    // maps are also persisted to directory, which must exist; an empty one keeps them in memory
+    void set_directory(const std::string &directory)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        directory_ = directory;
+    }
+
+    void set_budget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.budget_bytes = bytes;
+        evict_locked();
+    }
+
+    ShadowCacheStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ShadowCacheStats ret = stats_;
+        ret.entries = entries_.size();
+        return ret;
+    }
+
+    // drops the maps kept in memory, e.g. after the model was edited in place; the key covers
+    // the geometry, so this only frees memory, files in the cache directory are left alone
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        stats_.resident_bytes = 0;
+    }
+};